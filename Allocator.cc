@@ -0,0 +1,311 @@
+#include <string.h>
+#include "Allocator.h"
+#include "Stats.h"
+
+/**
+ * @brief Loads 64 blocks of the bitmap as a big-endian word: block 64*word+k is bit 63-k
+ *
+ * @param word - word index
+ * @return Used bits of the word, blocks past the end of the bitmap read as free
+ */
+uint64_t Block_allocator::load(int word) const {
+	uint8_t bytes[8] = {0};
+	int n = (num_blocks+7)/8 - word*8;
+	memcpy(bytes, bitmap + word*8, n < 8 ? n : 8);
+	uint64_t value;
+	memcpy(&value, bytes, 8);
+	return __builtin_bswap64(value);
+}
+
+/**
+ * @brief Stores a word loaded with load() back into the bitmap
+ *
+ * @param word - word index
+ * @param value - used bits of the word
+ */
+void Block_allocator::store(int word, uint64_t value){
+	value = __builtin_bswap64(value);
+	int n = (num_blocks+7)/8 - word*8;
+	memcpy(bitmap + word*8, &value, n < 8 ? n : 8);
+}
+
+/**
+ * @brief Blocks of a word that searches must skip: used blocks, blocks past the last block and, while reservations
+ * are honored, reserved blocks
+ *
+ * @param word - word index
+ */
+uint64_t Block_allocator::busy(int word) const {
+	return load(word) | tail_mask(word) | (honor_reserved ? reserved[word] : 0);
+}
+
+/**
+ * @brief Bits of a word that lie past the last block, which scans treat as used
+ *
+ * @param word - word index
+ */
+uint64_t Block_allocator::tail_mask(int word) const {
+	int valid = num_blocks - word*64;
+	return valid >= 64 ? 0 : (~0ULL >> valid);
+}
+
+void Block_allocator::attach(char *free_block_list, int blocks){
+	bitmap = (uint8_t *)free_block_list;
+	num_blocks = blocks;
+	num_words = (blocks+63)/64;
+	cursor = 0;
+	failed = 0;
+	honor_reserved = false;
+	reserved.assign(num_words, 0);
+	largest = 0;
+	for (int block = next_free(0); block < num_blocks; ){
+		int end = next_used(block);
+		if (end - block > largest) { largest = end - block; }
+		block = next_free(end);
+	}
+}
+
+bool Block_allocator::is_used(int block) const {
+	return (bitmap[block/8] >> (7 - block%8)) & 1;
+}
+
+void Block_allocator::set_run(int start, int len, bool used){
+	if (len <= 0) { return; }
+	int end = start+len;
+	for (int w = start/64; w*64 < end; w++){
+		int lo = start > w*64 ? start - w*64 : 0;
+		int hi = end < (w+1)*64 ? end - w*64 : 64;
+		uint64_t mask = (~0ULL >> lo) & ~(hi == 64 ? 0 : (~0ULL >> hi));
+		uint64_t value = load(w);
+		store(w, used ? (value | mask) : (value & ~mask));
+		if (used) { reserved[w] &= ~mask; } // allocating a reserved block takes it from its reservation
+	}
+	if (!used){ // the freed run may have merged with its neighbours into a larger extent
+		int extent = next_used(end) - (prev_used(start)+1);
+		if (extent > largest) { largest = extent; }
+	}
+}
+
+int Block_allocator::next_free(int from) const {
+	for (int w = from/64; w < num_words; w++){
+		uint64_t free_bits = ~busy(w);
+		if (w == from/64) { free_bits &= ~0ULL >> (from%64); }
+		if (free_bits) { return w*64 + __builtin_clzll(free_bits); }
+	}
+	return num_blocks;
+}
+
+int Block_allocator::next_used(int from) const {
+	for (int w = from/64; w < num_words; w++){
+		uint64_t used_bits = busy(w);
+		if (w == from/64) { used_bits &= ~0ULL >> (from%64); }
+		if (used_bits) {
+			int block = w*64 + __builtin_clzll(used_bits);
+			return block < num_blocks ? block : num_blocks;
+		}
+	}
+	return num_blocks;
+}
+
+int Block_allocator::next_claimed(int from) const {
+	for (int w = from/64; w < num_words; w++){
+		uint64_t claimed_bits = load(w) | tail_mask(w) | reserved[w];
+		if (w == from/64) { claimed_bits &= ~0ULL >> (from%64); }
+		if (claimed_bits) {
+			int block = w*64 + __builtin_clzll(claimed_bits);
+			return block < num_blocks ? block : num_blocks;
+		}
+	}
+	return num_blocks;
+}
+
+int Block_allocator::prev_used(int before) const {
+	if (before <= 0) { return -1; }
+	for (int w = (before-1)/64; w >= 0; w--){
+		uint64_t used_bits = busy(w) & ~tail_mask(w);
+		int last = before - w*64; // blocks of this word before the limit
+		if (last < 64) { used_bits &= ~(~0ULL >> last); }
+		if (used_bits) { return w*64 + 63 - __builtin_ctzll(used_bits); }
+	}
+	return -1;
+}
+
+/**
+ * @brief Finds the first free extent starting in [from, to) that is at least len blocks long
+ *
+ * @param from - block to start from
+ * @param to - extents starting at or after this block are not considered
+ * @param len - number of blocks
+ * @param max_seen - raised to the length of the longest extent visited
+ * @return First block of the extent, or -1 if there is none
+ */
+int Block_allocator::first_fit(int from, int to, int len, int *max_seen) const {
+	int block = next_free(from);
+	while (block < to){
+		int end = next_used(block);
+		visited++;
+		if (end - block >= len) { return block; }
+		if (end - block > *max_seen) { *max_seen = end - block; }
+		block = next_free(end);
+	}
+	return -1;
+}
+
+/**
+ * @brief Finds the shortest free extent that is at least len blocks long, the lowest one on ties
+ *
+ * @param len - number of blocks
+ * @param max_seen - raised to the length of the longest extent visited
+ * @return First block of the extent, or -1 if there is none
+ */
+int Block_allocator::best_fit(int len, int *max_seen) const {
+	int best = -1;
+	int best_len = num_blocks+1;
+	for (int block = next_free(0); block < num_blocks; ){
+		int end = next_used(block);
+		visited++;
+		if (end - block >= len && end - block < best_len) {
+			best = block;
+			best_len = end - block;
+			if (best_len == len) { break; } // exact fit cannot be beaten
+		}
+		if (end - block > *max_seen) { *max_seen = end - block; }
+		block = next_free(end);
+	}
+	return best;
+}
+
+/**
+ * @brief Buddy-style placement. The free block list records only the blocks a file uses, so instead of splitting
+ * blocks into buddies the run is placed at an offset aligned to the request rounded up to a power of two, preferring
+ * an aligned slot whose whole power-of-two span is free. Falls back to first fit so it never fails when a run exists.
+ *
+ * @param len - number of blocks
+ * @return First block of the run, or -1 if there is none
+ */
+int Block_allocator::buddy_fit(int len) const {
+	int span = 1;
+	while (span < len) { span <<= 1; }
+	int fallback = -1;
+	for (int block = 0; block + len <= num_blocks; block += span){
+		int end = next_used(block);
+		visited++;
+		if (end - block >= span) { return block; } // whole buddy is free
+		if (fallback == -1 && end - block >= len) { fallback = block; }
+	}
+	if (fallback != -1) { return fallback; }
+	int unused = 0;
+	return first_fit(0, num_blocks, len, &unused);
+}
+
+/**
+ * @brief Searches for a run with the allocation policy
+ *
+ * @param len - number of blocks
+ * @param max_seen - raised to the length of the longest extent visited, if every extent was visited
+ * @return First block of the run, or -1 if there is none
+ */
+int Block_allocator::search(int len, int *max_seen){
+	int start = -1;
+	switch (policy){
+		case ALLOC_FIRST_FIT:
+			start = first_fit(0, num_blocks, len, max_seen);
+			break;
+		case ALLOC_NEXT_FIT:
+			start = first_fit(cursor < num_blocks ? cursor : 0, num_blocks, len, max_seen);
+			if (start == -1) { start = first_fit(0, num_blocks, len, max_seen); }
+			break;
+		case ALLOC_BEST_FIT:
+			start = best_fit(len, max_seen);
+			break;
+		case ALLOC_BUDDY:
+			start = buddy_fit(len);
+			*max_seen = largest;
+			break;
+	}
+	return start;
+}
+
+int Block_allocator::find_run(int len, int headroom){
+	int start = -1;
+	visited = 0;
+	if (len > 0 && len <= largest){
+		int max_seen = 0;
+		honor_reserved = reserved_count() > 0; // keep clear of other files' headroom while there is room elsewhere
+		if (headroom > 0 && len + headroom <= largest) { start = search(len + headroom, &max_seen); }
+		if (start == -1 && honor_reserved) { start = search(len, &max_seen); }
+		honor_reserved = false;
+		if (start == -1){
+			max_seen = 0;
+			start = search(len, &max_seen);
+			if (start == -1) { largest = max_seen; } // every extent was visited, so the bound is now exact
+		}
+	}
+	if (start == -1) { failed++; }
+	else { cursor = start + len; }
+	stats_add(STAT_ALLOC_SEARCHES, 1);
+	stats_add(STAT_ALLOC_EXTENTS, visited);
+	return start;
+}
+
+void Block_allocator::reserve_run(int start, int len, bool reserve){
+	if (len <= 0) { return; }
+	int end = start+len;
+	for (int w = start/64; w*64 < end; w++){
+		int lo = start > w*64 ? start - w*64 : 0;
+		int hi = end < (w+1)*64 ? end - w*64 : 64;
+		uint64_t mask = (~0ULL >> lo) & ~(hi == 64 ? 0 : (~0ULL >> hi));
+		if (reserve) { reserved[w] |= mask & ~load(w); } // only free blocks can be reserved
+		else { reserved[w] &= ~mask; }
+	}
+}
+
+void Block_allocator::clear_reservations(){
+	reserved.assign(num_words, 0);
+}
+
+int Block_allocator::reserved_count() const {
+	int count = 0;
+	for (int w = 0; w < num_words; w++) { count += __builtin_popcountll(reserved[w]); }
+	return count;
+}
+
+bool Block_allocator::parse_policy(const char *name, Alloc_policy *result){
+	for (int p = ALLOC_FIRST_FIT; p <= ALLOC_BUDDY; p++){
+		const char *full = policy_name((Alloc_policy)p);
+		if (strcmp(name, full)==0 || (strncmp(name, full, strlen(name))==0 && full[strlen(name)]=='-')){
+			*result = (Alloc_policy)p;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char * Block_allocator::policy_name(Alloc_policy policy){
+	switch (policy){
+		case ALLOC_FIRST_FIT: return "first-fit";
+		case ALLOC_NEXT_FIT: return "next-fit";
+		case ALLOC_BEST_FIT: return "best-fit";
+		case ALLOC_BUDDY: return "buddy";
+	}
+	return "";
+}
+
+int Block_allocator::extent_histogram(int *histogram, int num_buckets) const {
+	int max_len = 0;
+	for (int i=0; i<num_buckets; i++) { histogram[i] = 0; }
+	for (int block = next_free(0); block < num_blocks; ){
+		int end = next_used(block);
+		int bucket = 31 - __builtin_clz(end - block);
+		histogram[bucket < num_buckets ? bucket : num_buckets-1]++;
+		if (end - block > max_len) { max_len = end - block; }
+		block = next_free(end);
+	}
+	return max_len;
+}
+
+int Block_allocator::free_count() const {
+	int count = 0;
+	for (int w = 0; w < num_words; w++) { count += __builtin_popcountll(~(load(w) | tail_mask(w))); }
+	return count;
+}
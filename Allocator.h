@@ -0,0 +1,178 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <stdint.h>
+#include <vector>
+
+typedef enum {
+	ALLOC_FIRST_FIT, // lowest free run that fits
+	ALLOC_NEXT_FIT,  // first run that fits after the previous allocation, wrapping around
+	ALLOC_BEST_FIT,  // smallest free run that fits
+	ALLOC_BUDDY      // run aligned to the request rounded up to a power of two
+} Alloc_policy;
+
+/**
+ * @brief Contiguous block allocator working directly on the free block list of a superblock.
+ * The free block list stores block b in byte b/8, most significant bit first, so loading 8 bytes as a
+ * big-endian 64 bit word puts block 64w+k at bit 63-k and bit scans can walk 64 blocks at a time.
+ * An upper bound on the largest free extent lets requests that cannot fit fail without scanning.
+ * Where a run is placed is decided by the allocation policy. Free blocks can be reserved as growth headroom for a
+ * file; searches avoid reserved blocks and only take them when there is no other room.
+ */
+class Block_allocator {
+public:
+	/**
+	 * @brief Attaches the allocator to a free block list and computes its largest free extent
+	 *
+	 * @param free_block_list - bitmap of used blocks, one bit per block
+	 * @param num_blocks - number of blocks described by the bitmap
+	 */
+	void attach(char *free_block_list, int num_blocks);
+
+	/**
+	 * @brief Checks if a block is marked as used
+	 *
+	 * @param block - block number
+	 */
+	bool is_used(int block) const;
+
+	/**
+	 * @brief Marks a run of blocks as used or free, a whole word at a time
+	 *
+	 * @param start - first block of the run
+	 * @param len - number of blocks
+	 * @param used - true to mark the blocks used, false to free them
+	 */
+	void set_run(int start, int len, bool used);
+
+	/**
+	 * @brief Finds a run of free blocks of the given length according to the allocation policy.
+	 * The run is not marked as used.
+	 *
+	 * @param len - number of blocks
+	 * @param headroom - free blocks wanted after the run, if a run with them can be found
+	 * @return First block of the run, or -1 if there is no free run of that length
+	 */
+	int find_run(int len, int headroom = 0);
+
+	/**
+	 * @brief Reserves free blocks, or releases reserved blocks, so other allocations avoid them while they can
+	 *
+	 * @param start - first block of the run
+	 * @param len - number of blocks
+	 * @param reserve - true to reserve the free blocks of the run, false to release the run
+	 */
+	void reserve_run(int start, int len, bool reserve);
+
+	/**
+	 * @brief Releases every reservation
+	 */
+	void clear_reservations();
+
+	/**
+	 * @brief Counts the reserved blocks
+	 */
+	int reserved_count() const;
+
+	/**
+	 * @brief Sets the policy used by find_run
+	 */
+	void set_policy(Alloc_policy new_policy) { policy = new_policy; }
+
+	Alloc_policy get_policy() const { return policy; }
+
+	/**
+	 * @brief Parses a policy name: "first", "next", "best" or "buddy"
+	 *
+	 * @param name - policy name
+	 * @param result - set to the policy if the name is valid
+	 * @return false if the name is not a policy
+	 */
+	static bool parse_policy(const char *name, Alloc_policy *result);
+
+	/**
+	 * @brief Name of a policy as printed in reports
+	 */
+	static const char * policy_name(Alloc_policy policy);
+
+	/**
+	 * @brief Counts the free extents by size class: bucket k holds extents of 2^k to 2^(k+1)-1 blocks
+	 *
+	 * @param histogram - array of at least num_buckets counters, overwritten
+	 * @param num_buckets - number of size classes, larger extents are counted in the last one
+	 * @return Length of the largest free extent
+	 */
+	int extent_histogram(int *histogram, int num_buckets) const;
+
+	/**
+	 * @brief Number of calls to find_run that found no run since the allocator was attached
+	 */
+	int failed_allocations() const { return failed; }
+
+	/**
+	 * @brief Finds the first free block at or after a block
+	 *
+	 * @param from - block to start from
+	 * @return Block number, or the number of blocks if there is none
+	 */
+	int next_free(int from) const;
+
+	/**
+	 * @brief Finds the first used block at or after a block
+	 *
+	 * @param from - block to start from
+	 * @return Block number, or the number of blocks if there is none
+	 */
+	int next_used(int from) const;
+
+	/**
+	 * @brief Finds the first block at or after a block that is used or reserved
+	 *
+	 * @param from - block to start from
+	 * @return Block number, or the number of blocks if there is none
+	 */
+	int next_claimed(int from) const;
+
+	/**
+	 * @brief Finds the last used block before a block
+	 *
+	 * @param before - block to search back from (exclusive)
+	 * @return Block number, or -1 if there is none
+	 */
+	int prev_used(int before) const;
+
+	/**
+	 * @brief Counts the free blocks
+	 */
+	int free_count() const;
+
+	/**
+	 * @brief Upper bound on the length of the largest free run. Exact after attach and after a failed search.
+	 */
+	int largest_free() const { return largest; }
+
+	int size() const { return num_blocks; }
+
+private:
+	uint8_t *bitmap = 0;
+	int num_blocks = 0;
+	int num_words = 0;
+	int largest = 0;
+	Alloc_policy policy = ALLOC_FIRST_FIT;
+	int cursor = 0; // next fit resumes its search here
+	int failed = 0;
+	std::vector<uint64_t> reserved; // reserved blocks, in the same word layout as load()
+	bool honor_reserved = false; // searches treat reserved blocks as used
+	mutable int visited = 0; // free extents visited by the current search
+
+	uint64_t load(int word) const;
+	void store(int word, uint64_t value);
+	uint64_t tail_mask(int word) const;
+	uint64_t busy(int word) const;
+	int search(int len, int *max_seen);
+	int first_fit(int from, int to, int len, int *max_seen) const;
+	int best_fit(int len, int *max_seen) const;
+	int buddy_fit(int len) const;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#include "Block_checksums.h"
+#include "Stats.h"
+
+#define CRC32C_POLY 0x82F63B78 // reflected Castagnoli polynomial
+
+/**
+ * @brief Tables for the portable CRC32C: table[0] advances the checksum by one byte, and table[k] by a byte followed
+ * by k zero bytes, so eight bytes are folded in with eight lookups
+ */
+typedef struct Crc_tables {
+	uint32_t table[8][256];
+	Crc_tables(){
+		for (int i=0; i<256; i++){
+			uint32_t crc = i;
+			for (int bit=0; bit<8; bit++) { crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1))); }
+			table[0][i] = crc;
+		}
+		for (int i=0; i<256; i++){
+			for (int k=1; k<8; k++) { table[k][i] = (table[k-1][i] >> 8) ^ table[0][table[k-1][i] & 0xFF]; }
+		}
+	}
+} Crc_tables;
+
+static uint32_t crc32c_portable(uint32_t crc, const uint8_t *p, size_t len){
+	static const Crc_tables tables;
+	const uint32_t (*t)[256] = tables.table;
+	for (; len >= 8; p += 8, len -= 8){
+		uint32_t lo, hi;
+		memcpy(&lo, p, 4); // little endian, as the checksum tables are stored
+		memcpy(&hi, p+4, 4);
+		lo ^= crc;
+		crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+			^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+	}
+	for (; len > 0; p++, len--) { crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF]; }
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len){
+	uint64_t crc64 = crc;
+	for (; len >= 8; p += 8, len -= 8){
+		uint64_t word;
+		memcpy(&word, p, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = (uint32_t)crc64;
+	for (; len > 0; p++, len--) { crc = _mm_crc32_u8(crc, *p); }
+	return crc;
+}
+#endif
+
+uint32_t crc32c(const void *data, size_t len){
+#if defined(__x86_64__)
+	static const bool hardware = __builtin_cpu_supports("sse4.2"); // checked once, the first time a block is checksummed
+	if (hardware) { return ~crc32c_sse42(~0u, (const uint8_t *)data, len); }
+#endif
+	return ~crc32c_portable(~0u, (const uint8_t *)data, len);
+}
+
+void Block_checksums::attach(uint8_t *table, int num_blocks, int block_size){
+	this->table = table;
+	this->block_size = block_size;
+	verified.assign(table != NULL ? num_blocks : 0, 0);
+	if (table != NULL){
+		std::vector<uint8_t> zeroes(block_size, 0);
+		zero_crc = crc32c(zeroes.data(), block_size);
+	}
+}
+
+void Block_checksums::update(int block, const uint8_t *data){
+	if (table == NULL) { return; }
+	set(block, crc32c(data, block_size));
+	__atomic_store_n(&verified[block], 1, __ATOMIC_RELAXED);
+}
+
+void Block_checksums::zero(int block){
+	if (table == NULL) { return; }
+	set(block, zero_crc);
+	__atomic_store_n(&verified[block], 1, __ATOMIC_RELAXED);
+}
+
+void Block_checksums::copy(int from, int to){
+	if (table == NULL) { return; }
+	set(to, get(from));
+	__atomic_store_n(&verified[to], 0, __ATOMIC_RELAXED);
+}
+
+bool Block_checksums::check(int block, const uint8_t *data){
+	stats_add(STAT_BLOCKS_VERIFIED, 1);
+	if (crc32c(data, block_size) != get(block)) { stats_add(STAT_CHECKSUM_ERRORS, 1); return false; }
+	return true;
+}
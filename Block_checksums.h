@@ -0,0 +1,106 @@
+#ifndef BLOCK_CHECKSUMS_H
+#define BLOCK_CHECKSUMS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+/**
+ * @brief CRC32C (Castagnoli) of a byte range, with the SSE4.2 crc32 instruction where the CPU has it and a table
+ * driven loop, eight bytes at a time, otherwise
+ *
+ * @param data - bytes to checksum
+ * @param len - number of bytes
+ */
+uint32_t crc32c(const void *data, size_t len);
+
+/**
+ * @brief Checksums of the data blocks of a disk formatted with them: a CRC32C of every block, kept in the superblock
+ * after the inode table, little endian, and written back with it. A change to a block changes its checksum with it:
+ * a written block is checksummed, a zeroed block takes the checksum of zeroes, and a moved or copied block takes the
+ * checksum of the block it came from, so a move that damages the data leaves a checksum that no longer matches.
+ * Blocks are verified lazily: the first time a block is read after it is loaded, moved or copied, its contents are
+ * checksummed and compared, and a block that matched is not checksummed again until it next changes or is evicted.
+ * Checksums change only with their block, under the lock of its file; blocks can be verified by several readers at once.
+ */
+class Block_checksums {
+public:
+	/**
+	 * @brief Uses the checksum table of a superblock, with every block unverified
+	 *
+	 * @param table - checksum table, one 4 byte entry per block of the disk, or NULL if the disk has none
+	 * @param num_blocks - number of blocks
+	 * @param block_size - bytes of a block
+	 */
+	void attach(uint8_t *table, int num_blocks, int block_size);
+
+	bool enabled() const { return table != NULL; }
+
+	/**
+	 * @brief Checksums the new contents of a block
+	 *
+	 * @param block - block number
+	 * @param data - a block of bytes
+	 */
+	void update(int block, const uint8_t *data);
+
+	/**
+	 * @brief Sets the checksum of a zeroed block
+	 *
+	 * @param block - block number
+	 */
+	void zero(int block);
+
+	/**
+	 * @brief Gives a block the checksum of the block copied or moved into it, to be verified when it is read
+	 *
+	 * @param from - block copied
+	 * @param to - block overwritten
+	 */
+	void copy(int from, int to);
+
+	/**
+	 * @brief Verifies a block that is read, unless it was verified since it last changed
+	 *
+	 * @param block - block number
+	 * @param data - contents of the block
+	 * @return false if the contents do not match the checksum
+	 */
+	bool verify(int block, const uint8_t *data){
+		if (table == NULL || __atomic_load_n(&verified[block], __ATOMIC_RELAXED)) { return true; }
+		if (!check(block, data)) { return false; }
+		__atomic_store_n(&verified[block], 1, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	/**
+	 * @brief Marks a block unverified, so it is verified when it is next read. Called when the block is evicted, since
+	 * it is loaded from the disk again.
+	 *
+	 * @param block - block number
+	 */
+	void forget(int block){
+		if (table != NULL) { __atomic_store_n(&verified[block], 0, __ATOMIC_RELAXED); }
+	}
+
+	/**
+	 * @brief Checksums the contents of a block and compares them with its checksum
+	 *
+	 * @param block - block number
+	 * @param data - contents of the block
+	 * @return false if the contents do not match the checksum
+	 */
+	bool check(int block, const uint8_t *data);
+
+private:
+	uint8_t *table = NULL; // checksum of every block, NULL if the disk has none
+	int block_size = 0;
+	uint32_t zero_crc = 0; // checksum of a zeroed block
+	std::vector<uint8_t> verified; // blocks whose contents matched their checksum since they last changed
+
+	uint32_t get(int block) const { uint32_t crc; memcpy(&crc, table + (size_t)block*4, 4); return crc; }
+	void set(int block, uint32_t crc) { memcpy(table + (size_t)block*4, &crc, 4); }
+};
+
+#endif
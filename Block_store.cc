@@ -0,0 +1,276 @@
+#include <string.h>
+#include <unistd.h>
+#include <new>
+#include "Block_store.h"
+#include "Stats.h"
+
+/**
+ * @brief Hashes the contents of a block 8 bytes at a time (FNV-1a over words)
+ *
+ * @param data - block to hash
+ * @param len - bytes of the block, a multiple of 8
+ */
+static uint64_t hash_block(const uint8_t *data, int len){
+	uint64_t h = 14695981039346656037ULL;
+	for (int i=0; i<len; i+=8){
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		h = (h ^ word) * 1099511628211ULL;
+	}
+	return h;
+}
+
+Block_store::Block_store() : chunks(new uint8_t *[MAX_CHUNKS]){
+	attach_paged(0, Legacy_geometry::block_size, false);
+}
+
+Block_store::~Block_store(){
+	for (int c=0; c<num_chunks; c++) { delete[] chunks[c]; }
+	delete[] chunks;
+}
+
+void Block_store::attach_flat(uint8_t *blocks, int block_size){
+	base = blocks;
+	page_size = block_size;
+	fd = -1;
+	resident = 0;
+	map.clear();
+	referenced.clear();
+	refs.clear();
+	free_pages.clear();
+	index.clear();
+}
+
+void Block_store::attach_paged(int num_blocks, int block_size, bool dedup_blocks, int disk_fd){
+	base = NULL;
+	dedup = dedup_blocks;
+	fd = disk_fd;
+	if (block_size != page_size){ // pages of another size cannot be reused
+		for (int c=0; c<num_chunks; c++) { delete[] chunks[c]; }
+		num_chunks = 0;
+		page_size = block_size;
+	}
+	if (num_chunks == 0) { chunks[num_chunks++] = new uint8_t[(size_t)PAGES_PER_CHUNK*page_size]; }
+	int num_pages = num_chunks*PAGES_PER_CHUNK;
+	refs.assign(num_pages, 0);
+	hashes.assign(num_pages, 0);
+	free_pages.clear();
+	for (int p=num_pages-1; p>0; p--) { free_pages.push_back(p); } // lowest pages are taken first
+	index.clear();
+	memset(page(0), 0, page_size); // every block starts out sharing the zeroed page 0, or on disk
+	refs[0] = (fd < 0 ? num_blocks : 0) + 1; // one more reference keeps the zeroed page from being freed
+	map.assign(num_blocks, fd < 0 ? 0 : NOT_LOADED);
+	referenced.assign(num_blocks, 0);
+	resident = 0;
+	hand = 0;
+	if (dedup) { hashes[0] = hash_block(page(0), page_size); index[hashes[0]] = 0; }
+}
+
+/**
+ * @brief Takes an unused page, allocating a new chunk of pages when there is none
+ *
+ * @return Page number, with no references
+ */
+int Block_store::new_page(){
+	if (free_pages.empty()){
+		if (num_chunks == MAX_CHUNKS) { throw std::bad_alloc(); }
+		chunks[num_chunks] = new uint8_t[(size_t)PAGES_PER_CHUNK*page_size];
+		for (int p=(num_chunks+1)*PAGES_PER_CHUNK-1; p>=num_chunks*PAGES_PER_CHUNK; p--) { free_pages.push_back(p); }
+		num_chunks++;
+		refs.resize(num_chunks*PAGES_PER_CHUNK, 0);
+		hashes.resize(num_chunks*PAGES_PER_CHUNK, 0);
+	}
+	int p = free_pages.back();
+	free_pages.pop_back();
+	resident++;
+	return p;
+}
+
+/**
+ * @brief Returns a page with no references to the unused pages
+ *
+ * @param p - page number
+ */
+void Block_store::free_page(int p){
+	free_pages.push_back(p);
+	resident--;
+}
+
+/**
+ * @brief Reads a block from the disk into a page. Zeroed blocks share the zeroed page, and with dedup set blocks
+ * share the page of identical contents. The caller holds the lock.
+ *
+ * @param block - block number
+ * @return Page holding the contents of the block on disk, with one more reference
+ */
+int Block_store::read_in(int block){
+	int fresh = new_page();
+	uint8_t *data = page(fresh);
+	if (read_disk(block, data) == NULL) { memset(data, 0, page_size); }
+	stats_add(STAT_BLOCKS_LOADED, 1);
+	int p = fresh;
+	if (dedup){
+		uint64_t hash = hash_block(data, page_size);
+		std::unordered_map<uint64_t, int>::iterator it = index.find(hash);
+		if (it != index.end() && memcmp(page(it->second), data, page_size)==0) { p = it->second; }
+		else { hashes[fresh] = hash; index.insert(std::make_pair(hash, fresh)); }
+	} else if (data[0]==0 && memcmp(data, data+1, page_size-1)==0) { p = 0; }
+	if (p != fresh) { free_page(fresh); }
+	refs[p]++;
+	return p;
+}
+
+/**
+ * @brief Loads a block from the disk if it is only on disk. The caller holds the lock.
+ *
+ * @param block - block number
+ * @return Page holding the block
+ */
+int Block_store::fetch(int block){
+	if (map[block] != NOT_LOADED) { return map[block]; }
+	int p = read_in(block);
+	referenced[block] = 1;
+	__atomic_store_n(&map[block], p, __ATOMIC_RELEASE); // published once the page is filled
+	return p;
+}
+
+const uint8_t * Block_store::read_disk(int block, uint8_t *buffer){
+	ssize_t n = pread(fd, buffer, page_size, (off_t)block*page_size);
+	if (n < 0) { return NULL; }
+	memset(buffer + n, 0, page_size - n); // past the end of a short disk
+	return buffer;
+}
+
+const uint8_t * Block_store::peek(int block, uint8_t *buffer){
+	if (base != NULL) { return base + (size_t)block*page_size; }
+	int p = __atomic_load_n(&map[block], __ATOMIC_ACQUIRE);
+	if (p != NOT_LOADED) { return read_page(p); }
+	return read_disk(block, buffer);
+}
+
+int Block_store::load(int block){
+	std::lock_guard<std::mutex> guard(lock);
+	return fetch(block);
+}
+
+void Block_store::trim(std::vector<int> &evicted){
+	if (fd < 0 || !over_capacity()) { return; }
+	std::lock_guard<std::mutex> guard(lock);
+	int target = capacity - capacity/8; // room for the blocks of the next commands before the next trim
+	int num_blocks = map.size();
+	for (int visited=0; visited < 2*num_blocks && resident > target; visited++, hand = (hand+1) % num_blocks){
+		int p = map[hand];
+		if (p <= 0 || refs[p] != 1) { continue; } // only on disk, zeroed or shared
+		if (referenced[hand]) { referenced[hand] = 0; continue; } // second chance
+		map[hand] = NOT_LOADED;
+		release(p);
+		evicted.push_back(hand);
+		stats_add(STAT_BLOCKS_EVICTED, 1);
+	}
+}
+
+/**
+ * @brief Removes a page from the dedup index, if it is the page indexed for its contents
+ *
+ * @param p - page number
+ */
+void Block_store::unindex(int p){
+	if (!dedup) { return; }
+	std::unordered_map<uint64_t, int>::iterator it = index.find(hashes[p]);
+	if (it != index.end() && it->second == p) { index.erase(it); }
+}
+
+/**
+ * @brief Drops a reference to a page, freeing the page when it was the last one
+ *
+ * @param p - page number
+ */
+void Block_store::release(int p){
+	if (--refs[p] > 0) { return; }
+	unindex(p);
+	free_page(p);
+}
+
+/**
+ * @brief Points a block at a page, dropping its reference to its old page
+ *
+ * @param block - block number
+ * @param p - page number
+ */
+void Block_store::set(int block, int p){
+	int old = map[block];
+	if (old == p) { return; }
+	refs[p]++;
+	__atomic_store_n(&map[block], p, __ATOMIC_RELEASE);
+	if (old != NOT_LOADED) { release(old); }
+}
+
+void Block_store::store(int block, const uint8_t *data){
+	if (base != NULL) { memcpy(base + (size_t)block*page_size, data, page_size); return; }
+	std::lock_guard<std::mutex> guard(lock);
+	int old = map[block];
+	uint64_t hash = 0;
+	if (dedup){
+		hash = hash_block(data, page_size);
+		std::unordered_map<uint64_t, int>::iterator it = index.find(hash);
+		if (it != index.end() && memcmp(page(it->second), data, page_size)==0) { set(block, it->second); return; }
+	}
+	if (old > 0 && refs[old] == 1){ // not shared, written in place. The zeroed page is never written.
+		unindex(old);
+		memcpy(page(old), data, page_size);
+	} else {
+		int p = new_page();
+		memcpy(page(p), data, page_size);
+		set(block, p);
+	}
+	if (dedup){
+		hashes[map[block]] = hash;
+		index.insert(std::make_pair(hash, map[block])); // keeps the page already indexed on a hash collision
+	}
+}
+
+void Block_store::zero(int block){
+	if (base != NULL) { memset(base + (size_t)block*page_size, 0, page_size); return; }
+	std::lock_guard<std::mutex> guard(lock);
+	set(block, 0);
+}
+
+void Block_store::copy(int from, int to){
+	if (base != NULL) { memmove(base + (size_t)to*page_size, base + (size_t)from*page_size, page_size); return; }
+	std::lock_guard<std::mutex> guard(lock);
+	set(to, fetch(from));
+}
+
+std::vector<int> Block_store::pin(){
+	std::lock_guard<std::mutex> guard(lock);
+	for (size_t b=0; b<map.size(); b++){
+		if (map[b] != NOT_LOADED) { refs[map[b]]++; }
+	}
+	return map;
+}
+
+int Block_store::keep(int block, int count){
+	std::lock_guard<std::mutex> guard(lock);
+	int p = read_in(block);
+	refs[p] += count-1;
+	return p;
+}
+
+void Block_store::unpin(const std::vector<int> &pages){
+	std::lock_guard<std::mutex> guard(lock);
+	for (size_t b=0; b<pages.size(); b++){
+		if (pages[b] != NOT_LOADED) { release(pages[b]); }
+	}
+}
+
+void Block_store::restore(const std::vector<int> &pages){
+	std::lock_guard<std::mutex> guard(lock);
+	for (size_t b=0; b<pages.size(); b++){
+		if (pages[b] != NOT_LOADED) { set(b, pages[b]); }
+		else if (map[b] != NOT_LOADED){ // the disk still holds the block as pinned
+			int old = map[b];
+			__atomic_store_n(&map[b], NOT_LOADED, __ATOMIC_RELEASE);
+			release(old);
+		}
+	}
+}
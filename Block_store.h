@@ -0,0 +1,215 @@
+#ifndef BLOCK_STORE_H
+#define BLOCK_STORE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "Geometry.h"
+
+#define PAGES_PER_CHUNK 64
+#define MAX_CHUNKS 65536 // pages are allocated in chunks that never move, up to 4M pages
+#define NOT_LOADED -1 // page of a block that is only on disk
+
+/**
+ * @brief Data blocks of the mounted disk, addressed by disk block number.
+ * A memory-mapped disk is used flat, in place. Otherwise every block refers to a reference counted page: copying a
+ * block shares its page, and a block is only given a page of its own when it is written while shared (copy on
+ * write), so the contiguous block numbers callers see stay the same however pages are shared. With dedup set,
+ * written blocks are also hashed, and blocks with identical contents share one page.
+ * Pages are never changed while shared, so blocks can be read without locking; changes are serialized by the store,
+ * and callers must not change a block while it is read.
+ * Paged blocks can be backed by the disk: they are then loaded on first access, and with a capacity set, trim evicts
+ * the blocks not used recently (CLOCK) once more pages than that are in memory, so memory use does not grow with the
+ * size of the disk.
+ */
+class Block_store {
+public:
+	Block_store();
+	~Block_store();
+	Block_store(const Block_store &) = delete;
+	Block_store & operator=(const Block_store &) = delete;
+
+	/**
+	 * @brief Uses the blocks of a memory-mapped disk in place, without sharing
+	 *
+	 * @param blocks - mapping of the disk, block b starts at blocks + b*block_size
+	 * @param block_size - bytes of a block
+	 */
+	void attach_flat(uint8_t *blocks, int block_size);
+
+	/**
+	 * @brief Keeps the blocks in reference counted pages, all sharing one zeroed page to begin with, or all on disk
+	 *
+	 * @param num_blocks - number of blocks
+	 * @param block_size - bytes of a block, at most MAX_BLOCK_SIZE
+	 * @param dedup - true to share the pages of blocks written with identical contents
+	 * @param fd - disk to load block b from offset b*block_size on first access, or -1 for zeroed blocks
+	 */
+	void attach_paged(int num_blocks, int block_size, bool dedup, int fd = -1);
+
+	bool is_paged() const { return base == NULL; }
+
+	/**
+	 * @brief Sets the number of pages above which trim evicts blocks backed by the disk
+	 *
+	 * @param pages - most pages in memory after a trim, 0 for no limit
+	 */
+	void set_capacity(int pages) { capacity = pages; }
+
+	/**
+	 * @brief Checks if more pages are in memory than the capacity allows
+	 */
+	bool over_capacity() const { return capacity > 0 && resident > capacity; }
+
+	/**
+	 * @brief Contents of a block, valid until the block is next changed or evicted. Loads the block if it is only on disk.
+	 *
+	 * @param block - block number
+	 */
+	const uint8_t * read(int block){
+		if (base != NULL) { return base + (size_t)block*page_size; }
+		int p = __atomic_load_n(&map[block], __ATOMIC_ACQUIRE); // blocks are loaded while others are read
+		if (p == NOT_LOADED) { p = load(block); }
+		else if (!__atomic_load_n(&referenced[block], __ATOMIC_RELAXED)) { __atomic_store_n(&referenced[block], 1, __ATOMIC_RELAXED); }
+		return read_page(p);
+	}
+
+	/**
+	 * @brief Contents of a block without loading it: its page if it is in memory, or its contents read from the disk
+	 * into a buffer, so a pass over the whole disk leaves the cache as it was
+	 *
+	 * @param block - block number
+	 * @param buffer - a block of bytes, filled if the block is only on disk
+	 * @return Contents of the block, or NULL if it cannot be read from the disk
+	 */
+	const uint8_t * peek(int block, uint8_t *buffer);
+
+	/**
+	 * @brief Contents of a block on disk, read into a buffer whether or not the block is in memory
+	 *
+	 * @param block - block number
+	 * @param buffer - a block of bytes, filled with the contents
+	 * @return The buffer, or NULL if the block cannot be read from the disk
+	 */
+	const uint8_t * read_disk(int block, uint8_t *buffer);
+
+	/**
+	 * @brief Loads a block if it is only on disk
+	 *
+	 * @param block - block number
+	 * @return Page holding the block
+	 */
+	int load(int block);
+
+	/**
+	 * @brief Evicts blocks backed by the disk until the pages in memory are back under 7/8 of the capacity. Blocks
+	 * are visited in CLOCK order, and a block read since the last visit is kept once more. Only blocks holding a page
+	 * of their own are evicted, since evicting a shared page frees nothing. The caller must have written every changed
+	 * block back to the disk, and no block may be read during the trim.
+	 *
+	 * @param evicted - the evicted blocks are appended to it
+	 */
+	void trim(std::vector<int> &evicted);
+
+	/**
+	 * @brief Replaces the contents of a block
+	 *
+	 * @param block - block number
+	 * @param data - a block of bytes
+	 */
+	void store(int block, const uint8_t *data);
+
+	/**
+	 * @brief Zeroes a block
+	 *
+	 * @param block - block number
+	 */
+	void zero(int block);
+
+	/**
+	 * @brief Copies a block to another block, sharing its page when paged
+	 *
+	 * @param from - block to copy
+	 * @param to - block to overwrite
+	 */
+	void copy(int from, int to);
+
+	/**
+	 * @brief Page holding a block when paged, blocks with the same page have the same contents. NOT_LOADED for a
+	 * block that is only on disk.
+	 *
+	 * @param block - block number
+	 */
+	int page_of(int block) const { return base != NULL ? block : map[block]; }
+
+	/**
+	 * @brief Takes a reference to the page of every block, so later changes to the blocks copy them instead of
+	 * changing the pages. Blocks only on disk are pinned as NOT_LOADED without reading them: before such a block is
+	 * written back over, keep must read its old contents into a page for the pin. Only paged blocks can be pinned.
+	 *
+	 * @return Page of every block, to pass to restore and unpin
+	 */
+	std::vector<int> pin();
+
+	/**
+	 * @brief Reads the contents a block has on disk into a page, for pins that hold the block as NOT_LOADED
+	 *
+	 * @param block - block number
+	 * @param count - number of pins to take the page for
+	 * @return Page holding the contents, with count references
+	 */
+	int keep(int block, int count);
+
+	/**
+	 * @brief Drops the references taken by pin
+	 *
+	 * @param pages - pages returned by pin
+	 */
+	void unpin(const std::vector<int> &pages);
+
+	/**
+	 * @brief Points every block back at the pages returned by pin, which stay pinned. Blocks pinned as NOT_LOADED go
+	 * back to their contents on disk.
+	 *
+	 * @param pages - pages returned by pin
+	 */
+	void restore(const std::vector<int> &pages);
+
+	/**
+	 * @brief Contents of a page, which must be pinned or in use, and not NOT_LOADED
+	 *
+	 * @param p - page number
+	 */
+	const uint8_t * read_page(int p) const { return chunks[p/PAGES_PER_CHUNK] + (size_t)(p%PAGES_PER_CHUNK)*page_size; }
+
+private:
+	uint8_t *base = NULL; // flat blocks of a mapped disk, NULL when paged
+	int page_size = 0; // bytes of a block, and of a page
+	bool dedup = false;
+	int fd = -1; // disk backing the blocks, -1 if there is none
+	int capacity = 0; // most pages kept by trim, 0 for no limit
+	std::atomic<int> resident{0}; // pages in use, besides the zeroed page
+	int hand = 0; // next block visited by trim
+	std::mutex lock; // guards the pages while paged
+	uint8_t **chunks; // MAX_CHUNKS chunks of PAGES_PER_CHUNK pages, allocated as they are needed
+	int num_chunks = 0;
+	std::vector<int> map; // page of every block
+	std::vector<uint8_t> referenced; // blocks read since trim last visited them
+	std::vector<int> refs; // blocks referring to every page
+	std::vector<uint64_t> hashes; // hash of every page in the dedup index
+	std::vector<int> free_pages;
+	std::unordered_map<uint64_t, int> index; // page holding the contents with each hash, when dedup is set
+
+	uint8_t * page(int p) { return chunks[p/PAGES_PER_CHUNK] + (size_t)(p%PAGES_PER_CHUNK)*page_size; }
+	int new_page();
+	void free_page(int p);
+	int read_in(int block);
+	int fetch(int block);
+	void release(int p);
+	void unindex(int p);
+	void set(int block, int p);
+};
+
+#endif
@@ -0,0 +1,210 @@
+#include <string.h>
+#include <stdio.h>
+#include <thread>
+#include <algorithm>
+#include "Checker.h"
+
+#define PARALLEL_CHECK_INODES 4096 // smaller inode tables are checked on the calling thread
+
+typedef struct {
+	std::vector<uint64_t> used;     // blocks used by the files seen, bit b%64 of word b/64
+	std::vector<uint64_t> shared;   // blocks used by more than one of the files seen
+	std::vector<std::vector<int>> named; // inodes in use whose parent can be a directory, by partition of the parent
+	std::vector<Violation> found;
+} Check_state;
+
+/**
+ * @brief Adds a violation to a list
+ */
+static void report(std::vector<Violation> &found, int code, int inode, const char *format, int arg){
+	char message[96];
+	snprintf(message, sizeof(message), format, arg);
+	Violation v = { code, inode, message };
+	found.push_back(v);
+}
+
+/**
+ * @brief Per-inode checks (1, 3, 4, 5 and 6) for a range of inodes. Records the blocks used by files, and the blocks
+ * used more than once, for the free block list check, and sorts the inodes in use by the partition of their parent
+ * for the name check.
+ *
+ * @param g - geometry of the disk
+ * @param inodes - inode table to check
+ * @param first - first inode index
+ * @param last - inode index past the end of the range
+ * @param num_partitions - number of partitions of the directories for the name check
+ * @param state - receives the blocks used, the inodes of each partition and the violations found
+ */
+template <typename G>
+static void check_inodes(const G &g, const Inode *inodes, int first, int last, int num_partitions, Check_state &state){
+	char name_mask[5] = {0};
+	const int first_data = meta_blocks(g);
+	const int root = root_dir(g);
+	for (int i=first; i<last; i++){
+		const Inode &node = inodes[i];
+
+		// first check: blocks of files are counted against the free block list, even for inodes marked free
+		if (!node.is_dir && node.start_block >= first_data && node.start_block < g.num_blocks){
+			for (int b = node.start_block; b < node.start_block + node.size; b++){
+				if (b >= g.num_blocks) { report(state.found, 1, i, "file extends past block %d", g.num_blocks-1); break; }
+				uint64_t bit = 1ULL << (b%64);
+				if (state.used[b/64] & bit) { state.shared[b/64] |= bit; }
+				state.used[b/64] |= bit;
+			}
+		}
+
+		// third check: free inodes are all zero, inodes in use have a name
+		if (!node.in_use){
+			if (memcmp(node.name, name_mask, 5)!=0 || node.is_dir || node.size!=0 || node.start_block!=0 || node.parent!=0){
+				report(state.found, 3, i, "free inode is not zeroed", 0);
+			}
+			continue;
+		}
+		if (memcmp(node.name, name_mask, 5)==0) { report(state.found, 3, i, "inode in use has no name", 0); }
+
+		// fourth check: start block of a file is a data block
+		if (!node.is_dir && (node.start_block < first_data || node.start_block >= g.num_blocks)){
+			report(state.found, 4, i, "start block %d of file is out of range", node.start_block);
+		}
+
+		// fifth check: size and start block of a directory are zero
+		if (node.is_dir && (node.size!=0 || node.start_block!=0)){
+			report(state.found, 5, i, "directory has a size or start block", 0);
+		}
+
+		// sixth check: parent is root, or a directory in use
+		int parent = node.parent;
+		if (parent != root && (parent >= g.num_inodes || !inodes[parent].is_dir || !inodes[parent].in_use)){
+			report(state.found, 6, i, "parent %d is not a directory in use", parent);
+		}
+		if (parent <= root) { state.named[parent % num_partitions].push_back(i); } // other parents fail the sixth check
+	}
+}
+
+/**
+ * @brief Second check for the directories in one partition: adds the inodes in use whose parent falls in the
+ * partition to the directory index, in inode order, and reports names that are already taken. Only the inodes
+ * check_inodes sorted into the partition are visited, range by range, so the inode table is walked once in all.
+ * Partitions touch disjoint directories of the index, so they can be built by different threads.
+ *
+ * @param inodes - inode table to check
+ * @param index - directory index being built
+ * @param states - states of the ranges checked by check_inodes, in inode order
+ * @param partition - partition handled by this call
+ * @param found - receives the violations found
+ */
+static void check_names(const Inode *inodes, Dir_index &index, const std::vector<Check_state> &states, int partition, std::vector<Violation> &found){
+	for (size_t t=0; t<states.size(); t++){
+		const std::vector<int> &named = states[t].named[partition];
+		for (size_t k=0; k<named.size(); k++){
+			int i = named[k];
+			if (!index.add(inodes[i].parent, i, inodes[i].name)) { report(found, 2, i, "name is not unique in directory %d", inodes[i].parent); }
+		}
+	}
+}
+
+/**
+ * @brief Compares the free block list with the blocks used by files and the superblock, a byte of the list at a time
+ *
+ * @param g - geometry of the disk
+ * @param free_block_list - free block list to check
+ * @param used - blocks used, bit b%64 of word b/64
+ * @param shared - blocks used more than once
+ * @param violations - receives the violations found
+ */
+template <typename G>
+static void check_free_list(const G &g, const uint8_t *free_block_list, const std::vector<uint64_t> &used, const std::vector<uint64_t> &shared, std::vector<Violation> &violations){
+	for (int byte=0; byte<g.num_blocks/8; byte++){
+		uint8_t file_bits = used[byte/8] >> (8*(byte%8)); // block 8*byte+k is bit k here, and bit 7-k in the list
+		uint8_t shared_bits = shared[byte/8] >> (8*(byte%8));
+		uint8_t marked_bits = free_block_list[byte];
+		uint8_t reversed = 0;
+		for (int k=0; k<8; k++) { reversed |= ((marked_bits >> (7-k)) & 1) << k; }
+		if (file_bits == reversed && shared_bits == 0) { continue; }
+		for (int k=0; k<8; k++){
+			int b = byte*8 + k;
+			bool file_uses = (file_bits >> k) & 1;
+			bool marked = (reversed >> k) & 1;
+			if ((shared_bits >> k) & 1) { report(violations, 1, -1, "block %d is used by more than one file", b); }
+			if (file_uses && !marked) { report(violations, 1, -1, "block %d is used but marked free", b); }
+			if (!file_uses && marked) { report(violations, 1, -1, "block %d is marked used but no file uses it", b); }
+		}
+	}
+}
+
+template <typename G>
+static int check(const G &g, const uint8_t *free_block_list, const Inode *inodes, Dir_index &index, std::vector<Violation> &violations){
+	int num_threads = 1;
+	if (g.num_inodes >= PARALLEL_CHECK_INODES) {
+		num_threads = std::max(1, std::min((int)std::thread::hardware_concurrency(), g.num_inodes / (PARALLEL_CHECK_INODES/4)));
+	}
+	std::vector<Check_state> states(num_threads);
+	std::vector<std::vector<Violation>> name_violations(num_threads);
+	for (int t=0; t<num_threads; t++){
+		states[t].used.assign((g.num_blocks+63)/64, 0);
+		states[t].shared.assign((g.num_blocks+63)/64, 0);
+		states[t].named.resize(num_threads);
+	}
+	index.clear(root_dir(g)+1);
+	if (num_threads == 1){
+		check_inodes(g, inodes, 0, g.num_inodes, 1, states[0]);
+		check_names(inodes, index, states, 0, name_violations[0]);
+	} else { // every range is sorted into partitions before any partition is checked
+		std::vector<std::thread> threads;
+		for (int t=0; t<num_threads; t++){
+			threads.push_back(std::thread([&, t](){
+				check_inodes(g, inodes, (int)((int64_t)g.num_inodes*t/num_threads), (int)((int64_t)g.num_inodes*(t+1)/num_threads), num_threads, states[t]);
+			}));
+		}
+		for (int t=0; t<num_threads; t++) { threads[t].join(); }
+		threads.clear();
+		for (int t=0; t<num_threads; t++){
+			threads.push_back(std::thread([&, t](){ check_names(inodes, index, states, t, name_violations[t]); }));
+		}
+		for (int t=0; t<num_threads; t++) { threads[t].join(); }
+	}
+
+	// merge the blocks seen by each thread, a block seen by two threads is shared
+	std::vector<uint64_t> used = states[0].used;
+	std::vector<uint64_t> shared = states[0].shared;
+	for (int t=1; t<num_threads; t++){
+		for (size_t w=0; w<used.size(); w++){
+			shared[w] |= states[t].shared[w] | (used[w] & states[t].used[w]);
+			used[w] |= states[t].used[w];
+		}
+	}
+	for (int b=0; b<meta_blocks(g); b++) { used[b/64] |= 1ULL << (b%64); } // the first blocks hold the superblock
+	check_free_list(g, free_block_list, used, shared, violations);
+	for (int t=0; t<num_threads; t++){
+		violations.insert(violations.end(), states[t].found.begin(), states[t].found.end());
+		violations.insert(violations.end(), name_violations[t].begin(), name_violations[t].end());
+	}
+
+	std::stable_sort(violations.begin(), violations.end(), [](const Violation &a, const Violation &b){ return a.code < b.code; });
+	return violations.empty() ? 0 : violations[0].code;
+}
+
+int check_superblock(const Geometry &geometry, const uint8_t *free_block_list, const std::vector<Inode> &inodes, Dir_index &index, std::vector<Violation> &violations){
+	int code = 0;
+	with_geometry(geometry, [&](const auto &g){ code = check(g, free_block_list, inodes.data(), index, violations); });
+	return code;
+}
+
+void build_dir_index(const Geometry &geometry, const std::vector<Inode> &inodes, Dir_index &index){
+	int root = root_dir(geometry);
+	index.clear(root+1);
+	for (int i=0; i<geometry.num_inodes; i++){
+		const Inode &node = inodes[i];
+		if (node.in_use && node.parent <= root) { index.add(node.parent, i, node.name); }
+	}
+}
+
+uint64_t checksum64(const void *data, size_t len){
+	const uint8_t *bytes = (const uint8_t *)data;
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i=0; i<len; i++){
+		h ^= bytes[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
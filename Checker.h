@@ -0,0 +1,51 @@
+#ifndef CHECKER_H
+#define CHECKER_H
+
+#include <string>
+#include <vector>
+#include "Geometry.h"
+#include "Dir_index.h"
+
+typedef struct {
+	int code;            // consistency check that failed (1-6)
+	int inode;           // inode index, or -1 for free block list violations
+	std::string message; // description of the violation
+} Violation;
+
+/**
+ * @brief Runs the six mount-time consistency checks on a superblock in a single pass over the inode table:
+ *  1. the free block list matches the blocks used by files and the superblock, and no block is used by more than one file
+ *  2. names are unique within each directory
+ *  3. free inodes are zeroed, inodes in use have a name
+ *  4. the start block of every file is a data block (between 1 and 127 on a legacy disk)
+ *  5. directories have a size and start block of zero
+ *  6. the parent of every inode in use is root or a directory in use
+ * Large inode tables are checked by several threads. Builds the directory index of the superblock as it goes.
+ *
+ * @param geometry - geometry of the disk
+ * @param free_block_list - free block list of the disk
+ * @param inodes - decoded inode table of the disk
+ * @param index - set to the directory index of the superblock
+ * @param violations - receives every violation found
+ * @return Lowest error code found, or 0 if the superblock is consistent
+ */
+int check_superblock(const Geometry &geometry, const uint8_t *free_block_list, const std::vector<Inode> &inodes, Dir_index &index, std::vector<Violation> &violations);
+
+/**
+ * @brief Builds the directory index of a superblock already known to be consistent, without checking it
+ *
+ * @param geometry - geometry of the disk
+ * @param inodes - decoded inode table of the disk
+ * @param index - set to the directory index of the superblock
+ */
+void build_dir_index(const Geometry &geometry, const std::vector<Inode> &inodes, Dir_index &index);
+
+/**
+ * @brief 64 bit FNV-1a checksum of a byte range
+ *
+ * @param data - bytes to checksum
+ * @param len - number of bytes
+ */
+uint64_t checksum64(const void *data, size_t len);
+
+#endif
@@ -0,0 +1,175 @@
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "Daemon.h"
+
+typedef struct {
+	Fs_options options;
+	std::mutex lock; // guards the members below
+	std::map<std::string, FileSystem *> disks; // file system serving every disk a client has mounted, by disk_key
+	FileSystem *unmounted; // runs the commands of clients that have not mounted a disk
+	std::set<int> clients; // connected sockets, shut down when the daemon stops
+	std::condition_variable done; // signalled when a client disconnects
+} Daemon;
+
+/**
+ * @brief Sends a whole buffer to a client
+ *
+ * @param fd - client socket
+ * @param data - bytes to send
+ * @param len - number of bytes
+ * @return false if the client has gone away
+ */
+static bool send_all(int fd, const char *data, size_t len){
+	while (len > 0){
+		ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+		if (n <= 0) { return false; }
+		data += n; len -= n;
+	}
+	return true;
+}
+
+/**
+ * @brief Key of the file system serving a disk: the device and inode of its image, so every path naming the same
+ * image finds the same file system. A disk that does not exist is keyed by its name, and fails to mount.
+ *
+ * @param name - disk name given to the mount command
+ */
+static std::string disk_key(const char *name){
+	struct stat st;
+	if (stat(name, &st) != 0) { return std::string("name:") + name; }
+	return std::to_string((unsigned long long)st.st_dev) + ":" + std::to_string((unsigned long long)st.st_ino);
+}
+
+/**
+ * @brief Runs a mount command on the file system serving the disk, creating it for the first client to mount the
+ * disk. The session moves to that file system if the disk mounts, and stays where it was otherwise.
+ *
+ * @param daemon - daemon state
+ * @param fs - file system the session is attached to
+ * @param session - session running the command
+ * @param line - mount command
+ * @param line_no - command number
+ * @return File system the session is attached to after the command
+ */
+static FileSystem * mount(Daemon &daemon, FileSystem *fs, Session &session, char *line, int line_no){
+	char name[22] = "";
+	if (sscanf(line, "M %21s", name) != 1 || strlen(name) > 20) { // not a valid mount, let the command report it
+		fs->process_command(session, line, line_no);
+		return fs;
+	}
+	FileSystem *target;
+	{
+		std::lock_guard<std::mutex> lock(daemon.lock);
+		FileSystem *&served = daemon.disks[disk_key(name)];
+		if (served == NULL) { served = new FileSystem(daemon.options, stderr); }
+		target = served;
+	}
+	if (target == fs) { fs->process_command(session, line, line_no); return fs; }
+	fs->detach(session);
+	target->attach(session);
+	target->process_command(session, line, line_no);
+	if (target->is_mounted()) { return target; }
+	target->detach(session);
+	fs->attach(session);
+	return fs;
+}
+
+/**
+ * @brief Runs the commands of one client until it disconnects
+ *
+ * @param daemon - daemon state
+ * @param fd - client socket
+ */
+static void serve_client(Daemon &daemon, int fd){
+	char *reply_text = NULL;
+	size_t reply_len = 0;
+	FILE *reply = open_memstream(&reply_text, &reply_len);
+	Session session = make_session(reply, reply);
+	session.input_file = "client";
+	FileSystem *fs = daemon.unmounted;
+	fs->attach(session);
+	std::string pending;
+	char chunk[4096];
+	int line_no = 0;
+	ssize_t n;
+	while ((n = read(fd, chunk, sizeof(chunk))) > 0){
+		pending.append(chunk, n);
+		size_t start = 0;
+		for (size_t end = pending.find('\n'); end != std::string::npos; end = pending.find('\n', start)){
+			char *line = &pending[start]; // run in place, the command is split where it lies
+			pending[end] = '\0';
+			start = end+1;
+			line_no++;
+			if (line[0]=='M') { fs = mount(daemon, fs, session, line, line_no); }
+			else { fs->process_command(session, line, line_no); }
+			fputc('\n', reply); // end of the reply to this command
+		}
+		pending.erase(0, start);
+		fflush(reply);
+		if (!send_all(fd, reply_text, reply_len)) { break; }
+		rewind(reply);
+	}
+	fs->detach(session);
+	fclose(reply);
+	free(reply_text);
+	std::lock_guard<std::mutex> lock(daemon.lock);
+	daemon.clients.erase(fd);
+	close(fd);
+	daemon.done.notify_all();
+}
+
+int run_daemon(const char *socket_path, const Fs_options &options){
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) { fprintf(stderr, "Error: Socket path %s is too long\n", socket_path); return 1; }
+	strcpy(addr.sun_path, socket_path);
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socket_path);
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr))!=0 || listen(listen_fd, SOMAXCONN)!=0){
+		fprintf(stderr, "Error: Cannot listen on socket %s\n", socket_path);
+		if (listen_fd >= 0) { close(listen_fd); }
+		return 1;
+	}
+
+	// SIGINT and SIGTERM are taken by a thread that stops accepting clients
+	sigset_t stop_signals;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+	std::thread([stop_signals, listen_fd](){
+		int sig;
+		sigwait(&stop_signals, &sig);
+		shutdown(listen_fd, SHUT_RDWR);
+	}).detach();
+
+	Daemon daemon;
+	daemon.options = options;
+	daemon.options.shared = true; // clients mounting the same disk join it
+	daemon.unmounted = new FileSystem(daemon.options, stderr);
+	for (int fd = accept(listen_fd, NULL, NULL); fd >= 0; fd = accept(listen_fd, NULL, NULL)){
+		std::lock_guard<std::mutex> lock(daemon.lock);
+		daemon.clients.insert(fd);
+		std::thread(serve_client, std::ref(daemon), fd).detach();
+	}
+	close(listen_fd);
+	unlink(socket_path);
+
+	std::unique_lock<std::mutex> lock(daemon.lock);
+	for (std::set<int>::iterator it = daemon.clients.begin(); it != daemon.clients.end(); ++it) { shutdown(*it, SHUT_RDWR); }
+	daemon.done.wait(lock, [&daemon](){ return daemon.clients.empty(); });
+	for (std::map<std::string, FileSystem *>::iterator it = daemon.disks.begin(); it != daemon.disks.end(); ++it) { delete it->second; }
+	delete daemon.unmounted;
+	return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "FileSystem.h"
+
+/**
+ * @brief Serves clients over a Unix domain socket until SIGINT or SIGTERM, keeping the disks they mount in memory.
+ * Every connection is a session reading one command per line, in the same format as an input file. A client can
+ * send many commands without waiting: the reply to each command (its output and error lines, in order) is followed
+ * by an empty line, and the replies to all the commands read together are sent back together.
+ * Each disk is served by one file system shared by every client that mounts it. Disks are written back according
+ * to the flush policy and unmounted when the daemon stops.
+ *
+ * @param socket_path - path of the socket, replaced if it exists
+ * @param options - options for every file system
+ * @return 0 when the daemon stops, 1 if the socket cannot be set up
+ */
+int run_daemon(const char *socket_path, const Fs_options &options);
+
+#endif
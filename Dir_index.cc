@@ -0,0 +1,101 @@
+#include <string.h>
+#include <algorithm>
+#include "Dir_index.h"
+#include "Stats.h"
+
+/**
+ * @brief FNV-1a hash of a name of up to 5 characters
+ *
+ * @param name - file or directory name
+ * @return 32 bit hash of the name
+ */
+uint32_t Dir_index::hash(const char *name){
+	uint32_t h = 2166136261u;
+	for (int i=0; i<5 && name[i]!='\0'; i++){
+		h ^= (uint8_t)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+ * @brief Places a name in the first free slot of its probe sequence
+ *
+ * @param slots - hash table with at least one free slot
+ * @param name - 5 byte name
+ * @param index - inode index stored with the name
+ */
+void Dir_index::insert_slot(std::vector<Slot> &slots, const char *name, int index){
+	size_t mask = slots.size()-1;
+	size_t i = hash(name) & mask;
+	while (slots[i].index != -1) { i = (i+1) & mask; }
+	memset(slots[i].name, 0, 5);
+	memcpy(slots[i].name, name, strnlen(name, 5));
+	slots[i].index = index;
+}
+
+void Dir_index::clear(int num_dirs){
+	dirs.resize(num_dirs);
+	for (int i=0; i<num_dirs; i++){
+		dirs[i].slots.clear();
+		dirs[i].children.clear();
+	}
+}
+
+bool Dir_index::add(int dir, int index, const char *name){
+	if (find(dir, name) != -1) { return false; }
+	Dir &d = dirs[dir];
+	if ((d.children.size()+1)*2 > d.slots.size()){ // keep the load factor at or below one half
+		Slot empty;
+		memset(empty.name, 0, 5);
+		empty.index = -1;
+		std::vector<Slot> grown(std::max((size_t)8, d.slots.size()*2), empty);
+		for (size_t i=0; i<d.slots.size(); i++){
+			if (d.slots[i].index != -1) { insert_slot(grown, d.slots[i].name, d.slots[i].index); }
+		}
+		d.slots.swap(grown);
+	}
+	insert_slot(d.slots, name, index);
+	d.children.push_back(index);
+	return true;
+}
+
+void Dir_index::remove(int dir, int index, const char *name){
+	Dir &d = dirs[dir];
+	std::vector<int>::iterator it = std::find(d.children.begin(), d.children.end(), index);
+	if (it != d.children.end()) { d.children.erase(it); }
+	if (d.slots.empty()) { return; }
+	size_t mask = d.slots.size()-1;
+	size_t i = hash(name) & mask;
+	while (d.slots[i].index != -1 && d.slots[i].index != index) { i = (i+1) & mask; }
+	if (d.slots[i].index == -1) { return; }
+	// backward-shift deletion: move later entries of the probe run into the hole so lookups never need tombstones
+	size_t hole = i;
+	for (size_t j = (i+1) & mask; d.slots[j].index != -1; j = (j+1) & mask){
+		size_t home = hash(d.slots[j].name) & mask;
+		if (((j - home) & mask) >= ((j - hole) & mask)){
+			d.slots[hole] = d.slots[j];
+			hole = j;
+		}
+	}
+	d.slots[hole].index = -1;
+}
+
+void Dir_index::drop(int dir){
+	std::vector<Slot>().swap(dirs[dir].slots);
+	std::vector<int>().swap(dirs[dir].children);
+}
+
+int Dir_index::find(int dir, const char *name) const {
+	const Dir &d = dirs[dir];
+	stats_add(STAT_DIR_LOOKUPS, 1);
+	if (d.slots.empty()) { return -1; }
+	size_t mask = d.slots.size()-1;
+	int probes = 1;
+	int found = -1;
+	for (size_t i = hash(name) & mask; d.slots[i].index != -1; i = (i+1) & mask, probes++){
+		if (strncmp(d.slots[i].name, name, 5)==0) { found = d.slots[i].index; break; }
+	}
+	stats_add(STAT_DIR_PROBES, probes);
+	return found;
+}
@@ -0,0 +1,88 @@
+#ifndef DIR_INDEX_H
+#define DIR_INDEX_H
+
+#include <stdint.h>
+#include <vector>
+
+/**
+ * @brief Index of the children of every directory, keyed by the inode number of the directory (root_dir() for root).
+ * Each directory keeps an open-addressing hash table of its children's 5 byte names for O(1) lookup, and
+ * the children in insertion order for listing.
+ */
+class Dir_index {
+public:
+	/**
+	 * @brief Removes every entry from the index and sizes it for the directories of a disk
+	 *
+	 * @param num_dirs - number of directory numbers, root included
+	 */
+	void clear(int num_dirs);
+
+	/**
+	 * @brief Adds a child to a directory
+	 *
+	 * @param dir - inode index of the directory
+	 * @param index - inode index of the child
+	 * @param name - 5 byte name of the child
+	 * @return false if the directory already has a child with the same name
+	 */
+	bool add(int dir, int index, const char *name);
+
+	/**
+	 * @brief Removes a child from a directory
+	 *
+	 * @param dir - inode index of the directory
+	 * @param index - inode index of the child
+	 * @param name - 5 byte name of the child
+	 */
+	void remove(int dir, int index, const char *name);
+
+	/**
+	 * @brief Removes every child of a directory at once and releases its hash table, for a directory deleted with
+	 * everything below it
+	 *
+	 * @param dir - inode index of the directory
+	 */
+	void drop(int dir);
+
+	/**
+	 * @brief Finds a child of a directory by name
+	 *
+	 * @param dir - inode index of the directory
+	 * @param name - file or directory name
+	 * @return Inode index of the child or -1 if not found
+	 */
+	int find(int dir, const char *name) const;
+
+	/**
+	 * @brief Children of a directory, in the order they were added
+	 *
+	 * @param dir - inode index of the directory
+	 */
+	const std::vector<int> & children(int dir) const { return dirs[dir].children; }
+
+	/**
+	 * @brief Number of children of a directory
+	 *
+	 * @param dir - inode index of the directory
+	 */
+	int size(int dir) const { return (int)dirs[dir].children.size(); }
+
+private:
+	typedef struct {
+		char name[5];
+		int32_t index; // inode index, -1 if the slot is empty
+	} Slot;
+
+	typedef struct {
+		std::vector<Slot> slots; // open-addressing table with linear probing, size is a power of two
+		std::vector<int> children;
+	} Dir;
+
+	std::vector<Dir> dirs;
+
+	static uint32_t hash(const char *name);
+	static void insert_slot(std::vector<Slot> &slots, const char *name, int index);
+};
+
+#endif
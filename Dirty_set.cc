@@ -0,0 +1,47 @@
+#include "Dirty_set.h"
+
+void Dirty_set::resize(int size){
+	num_members = size;
+	num_words = (size+63)/64;
+	num_summary = (num_words+63)/64;
+	words.reset(new std::atomic<uint64_t>[num_words]);
+	summary.reset(new std::atomic<uint64_t>[num_summary]);
+	for (int w=0; w<num_words; w++) { words[w].store(0, std::memory_order_relaxed); }
+	for (int s=0; s<num_summary; s++) { summary[s].store(0, std::memory_order_relaxed); }
+}
+
+void Dirty_set::add_all(){
+	for (int w=0; w<num_words; w++){
+		int valid = num_members - w*64;
+		words[w].store(valid >= 64 ? ~0ULL : (1ULL << valid) - 1, std::memory_order_relaxed);
+	}
+	for (int s=0; s<num_summary; s++){
+		int valid = num_words - s*64;
+		summary[s].store(valid >= 64 ? ~0ULL : (1ULL << valid) - 1, std::memory_order_relaxed);
+	}
+}
+
+int Dirty_set::next(int from) const {
+	if (from >= num_members) { return num_members; }
+	int w = from/64;
+	uint64_t bits = words[w].load(std::memory_order_relaxed) & (~0ULL << (from%64));
+	if (bits) { return w*64 + __builtin_ctzll(bits); }
+	for (int s = (w+1)/64; s < num_summary; s++){
+		uint64_t marked = summary[s].load(std::memory_order_relaxed);
+		if (s == (w+1)/64) { marked &= ~0ULL << ((w+1)%64); }
+		for (; marked; marked &= marked-1){
+			int word = s*64 + __builtin_ctzll(marked);
+			bits = words[word].load(std::memory_order_relaxed);
+			if (bits) { return word*64 + __builtin_ctzll(bits); }
+		}
+	}
+	return num_members;
+}
+
+void Dirty_set::clear(){
+	for (int s=0; s<num_summary; s++){
+		uint64_t marked = summary[s].load(std::memory_order_relaxed);
+		for (; marked; marked &= marked-1) { words[s*64 + __builtin_ctzll(marked)].store(0, std::memory_order_relaxed); }
+		summary[s].store(0, std::memory_order_relaxed);
+	}
+}
@@ -0,0 +1,71 @@
+#ifndef DIRTY_SET_H
+#define DIRTY_SET_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+/**
+ * @brief Set of the inodes, blocks or words of the free block list changed since the last write-back, one bit per
+ * member. Members are added by commands on any thread while they hold the disk shared, and walked in order and
+ * cleared by the write-back while it holds the disk exclusively. A summary bit for every 64 members lets the walk
+ * skip the unchanged parts of a large disk, so a write-back costs what changed rather than the size of the disk.
+ */
+class Dirty_set {
+public:
+	Dirty_set() = default;
+	Dirty_set(const Dirty_set &) = delete;
+	Dirty_set & operator=(const Dirty_set &) = delete;
+
+	/**
+	 * @brief Empties the set and sizes it for members 0 to size-1
+	 *
+	 * @param size - number of possible members
+	 */
+	void resize(int size);
+
+	/**
+	 * @brief Adds a member. Members can be added by several threads at once.
+	 *
+	 * @param i - member to add
+	 */
+	void add(int i){
+		uint64_t bit = 1ULL << (i%64);
+		if (words[i/64].load(std::memory_order_relaxed) & bit) { return; } // already changed since the last write-back
+		words[i/64].fetch_or(bit, std::memory_order_relaxed);
+		summary[i/4096].fetch_or(1ULL << ((i/64)%64), std::memory_order_relaxed);
+	}
+
+	/**
+	 * @brief Adds every possible member
+	 */
+	void add_all();
+
+	/**
+	 * @brief Finds the first member at or after a value
+	 *
+	 * @param from - value to start from
+	 * @return The member, or size() if there is none
+	 */
+	int next(int from) const;
+
+	bool empty() const { return next(0) == num_members; }
+
+	bool contains(int i) const { return (words[i/64].load(std::memory_order_relaxed) >> (i%64)) & 1; }
+
+	/**
+	 * @brief Removes every member, visiting only the words that hold one
+	 */
+	void clear();
+
+	int size() const { return num_members; }
+
+private:
+	std::unique_ptr<std::atomic<uint64_t>[]> words;   // member i is bit i%64 of word i/64
+	std::unique_ptr<std::atomic<uint64_t>[]> summary; // bit w%64 of summary word w/64 is set when word w may hold a member
+	int num_members = 0;
+	int num_words = 0;
+	int num_summary = 0;
+};
+
+#endif
@@ -7,77 +7,174 @@
 #include <map>
 #include <algorithm>
 #include <iterator>
+#include <thread>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include "FileSystem.h"
+#include "Geometry.h"
+#include "Dir_index.h"
+#include "Allocator.h"
+#include "Checker.h"
+#include "Journal.h"
+#include "Daemon.h"
+#include "Stats.h"
 
 using namespace std;
 
 typedef struct {
-	char name[5];        // Name of the file or directory
-	uint8_t used_size;   // Inode state and the size of the file or directory
-	uint8_t start_block; // Index of the start file block
-	uint8_t dir_parent;  // Inode mode and the index of the parent inode
-} Inode;
+	char magic[8];     // CLEAN_MAGIC
+	uint64_t checksum; // checksum64 of the superblock of the disk when it was unmounted
+} Clean_marker; // Contents of <disk>.clean, which exists only while a disk is cleanly unmounted
+#define CLEAN_MAGIC "FSCLEAN1"
+#define PARALLEL_SCRUB_BLOCKS 65536 // smaller disks are scrubbed on the calling thread
 
-typedef struct {
-	char free_block_list[16];
-	Inode inode[126];
-} Super_block;
+static std::atomic<uint64_t> next_generation{1}; // generation of the next mount, of any instance
+
+Session make_session(FILE *out, FILE *err){
+	Session session;
+	session.cwd = root_dir(Legacy_geometry()); // root of a legacy disk, until a disk is mounted
+	memset(session.buffer, 0, sizeof(session.buffer));
+	session.staging.clear();
+	session.out = out;
+	session.err = err;
+	session.input_file = "";
+	session.dentry_generation = 0;
+	return session;
+}
 
-typedef struct { uint8_t block[1024]; } Block; 
-Block blocks[127]; // Holds representation of the disk data blocks
-uint8_t buffer[1024]; // Data buffer for read/write operations
-char * input_file; // Input filename for running file system commands
-char * disk; // Name of mounted disk
-int line_no; // Input file line number for error handling
-int cwd; // Current working directory
-char root[5] = "root";
-std::map<char *, std::vector<int>> dir_names; // Map to store parent directory names and its children
-Super_block * superblock; 
+FileSystem::FileSystem(const Fs_options &options, FILE *err) : options(options), err(err){
+	set_geometry(legacy_geometry());
+	meta_buffer.assign(meta_bytes(geometry), 0);
+	meta = meta_buffer.data();
+	block_store.attach_paged(geometry.num_blocks, geometry.block_size, options.dedup);
+	block_store.set_capacity(options.cache_blocks);
+}
 
-void init(){
-	disk = (char*)malloc(sizeof(uint8_t) * 20);
-	superblock = new Super_block();
-	line_no = 0;
+FileSystem::~FileSystem(){
+	unmount();
 }
 
 /**
- * @brief Function to set the ith bit of a byte
+ * @brief Sizes the inodes, locks and change tracking for the geometry of a disk being mounted, with every inode
+ * free and nothing changed. The caller holds the disk exclusively.
  *
- * @param ch - The unsigned char containing the bit to be set
- * @param i - bit offset
- * @param val - The value to be set(1 or 0)
- * @return The new byte with modified bit
+ * @param new_geometry - geometry of the disk
  */
-unsigned char setBit(unsigned char ch, int i, int val ){
-	i = 8-i;
-	unsigned char mask = 1 << i ;
-	if( val == 1){ return ch | mask;}
-	else{ 
-		mask = ~mask;
-		return ch & mask;
+void FileSystem::set_geometry(const Geometry &new_geometry){
+	bool resize_locks = !dir_locks || root_dir(new_geometry) != root || new_geometry.num_inodes != geometry.num_inodes;
+	geometry = new_geometry;
+	disk_blocks = geometry.num_blocks;
+	root = root_dir(geometry);
+	first_data = meta_blocks(geometry);
+	if (resize_locks){ // no lock is held while the disk is held exclusively
+		dir_locks.reset(new std::shared_mutex[root+1]);
+		file_locks.reset(new std::shared_mutex[geometry.num_inodes]);
+		usage.reset(new Dir_usage[root+1]());
 	}
-} 
+	inodes.assign(geometry.num_inodes, Inode());
+	incarnation.assign(root+1, 0);
+	generation = next_generation++;
+	first_free_inode = 0;
+	headroom.assign(geometry.num_inodes, 0);
+	dirty_header = false;
+	dirty_free_list.resize(geometry.num_blocks/64);
+	dirty_inodes.resize(geometry.num_inodes);
+	dirty_blocks.resize(geometry.num_blocks);
+}
+
+/**
+ * @brief Sets the allocation state of a run of data blocks in the free block list
+ *
+ * @param start - first block number
+ * @param len - number of blocks
+ * @param val - 1 if the blocks are in use, 0 if they are free
+ */
+void FileSystem::set_blocks_state(int start, int len, int val){
+	if (len <= 0) { return; }
+	block_allocator.set_run(start, len, val == 1);
+	for (int w = start/64; w <= (start+len-1)/64; w++) { dirty_free_list.add(w); }
+}
 
 /**
  * @brief Function to zero out the members of an inode
  *
  * @param index - Inode index
  */
-void clear_inode(int index){
+void FileSystem::clear_inode(int index){
 	char mask[5] =  {'\0', '\0', '\0', '\0', '\0'};
-	memcpy(superblock->inode[index].name, mask, 5);
-	superblock->inode[index].used_size = 0;
-	superblock->inode[index].dir_parent = 0;
-	superblock->inode[index].start_block = 0;
+	memcpy(inodes[index].name, mask, 5);
+	inodes[index].in_use = false;
+	inodes[index].is_dir = false;
+	inodes[index].size = 0;
+	inodes[index].parent = 0;
+	inodes[index].start_block = 0;
+	if (index < first_free_inode) { first_free_inode = index; }
+	dirty_inodes.add(index);
+}
+
+/**
+ * @brief Finds the first free inode. The caller holds the allocator lock.
+ *
+ * @return Inode index, or -1 if every inode is in use
+ */
+int FileSystem::find_free_inode(void){
+	while (first_free_inode < geometry.num_inodes && inodes[first_free_inode].in_use) { first_free_inode++; }
+	return first_free_inode < geometry.num_inodes ? first_free_inode : -1;
 }
 
 /**
- * @brief Function to zero out data block
+ * @brief Function to zero out a run of data blocks
  *
- * @param index - block number
+ * @param start - first block number
+ * @param len - number of blocks
  */
-void clear_block(int index){
-	uint8_t mask[1024] = "";
-	memcpy(blocks[index].block, mask, 1024);
+void FileSystem::clear_blocks(int start, int len){
+	for (int i=0; i<len; i++){
+		block_store.zero(start+i);
+		block_checksums.zero(start+i);
+		dirty_blocks.add(start+i);
+	}
+}
+
+/**
+ * @brief Moves a run of data blocks, which may overlap its destination, and zeroes the blocks it no longer covers
+ *
+ * @param from - first block number of the run
+ * @param to - first block number of the destination
+ * @param len - number of blocks
+ */
+void FileSystem::move_blocks(int from, int to, int len){
+	if (len <= 0 || from == to) { return; }
+	stats_add(STAT_BLOCKS_MOVED, len);
+	for (int i=0; i<len; i++){ // copied in the direction that reads every block before it is overwritten
+		int b = (to < from) ? i : len-1-i;
+		block_store.copy(from+b, to+b);
+		block_checksums.copy(from+b, to+b);
+		dirty_blocks.add(to+b);
+	}
+	if (to < from) { clear_blocks(std::max(from, to+len), from+len-std::max(from, to+len)); }
+	else { clear_blocks(from, std::min(to, from+len)-from); }
+}
+
+/**
+ * @brief Copies a run of data blocks to a run that does not overlap it. Paged blocks share their pages with the copy.
+ *
+ * @param from - first block number of the run
+ * @param to - first block number of the destination
+ * @param len - number of blocks
+ */
+void FileSystem::copy_blocks(int from, int to, int len){
+	for (int i=0; i<len; i++){
+		block_store.copy(from+i, to+i);
+		block_checksums.copy(from+i, to+i);
+		dirty_blocks.add(to+i);
+	}
 }
 
 /**
@@ -86,326 +183,672 @@ void clear_block(int index){
  * @param index - Inode index
  * @return Boolean true if inode is a directory
  */
-bool isDir(int index){
-	return ((superblock->inode[index].dir_parent & 128) == 128);
+bool FileSystem::isDir(int index){
+	return inodes[index].is_dir;
 }
 
 /**
- * @brief Checks if the given file or directory name exists within the given directory name
+ * @brief Checks if the given file or directory name exists within the current working directory
  *
- * @param dir - directory name
+ * @param session - session running the command
  * @param name - file or directory name
  * @return Inode index of the file/directory name or -1 if not found
  */
-int check_dir_names(char * dir, char * name){
-	std::map<char *, std::vector<int>>::iterator dir_it;
-	std::vector<char *> names; // each dir has vector of file names
-	for (dir_it = dir_names.begin(); dir_it != dir_names.end(); dir_it++ ){ 
-		if(strncmp(dir_it->first, dir, 5)==0){
-			std::vector<int> val = dir_it->second; // list of inode indeces belonging to that dir
-			for (int i=0; i<(int)val.size(); i++){
-				if (strncmp(superblock->inode[val.at(i)].name, name, 5)==0) { return val.at(i); } // check if file names match
-			}
+int FileSystem::check_dir_names(Session &session, const char * name){
+	return dir_index.find(session.cwd, name);
+}
+
+/**
+ * @brief Resolves a directory path: names of at most 5 characters separated by '/', starting from root if it starts
+ * with '/' and from the current working directory otherwise, where "." and ".." stay and go up. A path resolved
+ * before is found in the session's cache with one lookup, and used if neither the directory it starts from nor the
+ * one it reaches has been deleted since. Only paths that resolve are cached, so creating a directory never leaves
+ * an entry stale, and paths that go up after going down (a/../b) are not, since the directory they go down to could
+ * be deleted without the others. The caller holds the disk, so no directory is deleted meanwhile.
+ *
+ * @param session - session running the command
+ * @param path - path of the directory
+ * @param len - length of the path
+ * @return Inode index of the directory, or -1 if the path does not lead to one
+ */
+int FileSystem::resolve_dir(Session &session, const char *path, size_t len){
+	int base = session.cwd;
+	if (len > 0 && path[0] == '/') { base = root; path++; len--; }
+	if (len == 0) { return base; }
+	if (session.dentry_generation != generation){
+		session.dentries.clear();
+		session.dentry_generation = generation;
+	}
+	std::string key((const char *)&base, sizeof(base));
+	key.append(path, len);
+	std::unordered_map<std::string, Dentry>::iterator cached = session.dentries.find(key);
+	if (cached != session.dentries.end() && cached->second.base_inc == incarnation[base] && cached->second.dir_inc == incarnation[cached->second.dir]){
+		stats_add(STAT_PATH_HITS, 1);
+		return cached->second.dir;
+	}
+	stats_add(STAT_PATH_MISSES, 1);
+	int dir = base;
+	bool descended = false, cacheable = true;
+	for (size_t start = 0; start <= len; ){
+		size_t end = start;
+		while (end < len && path[end] != '/') { end++; }
+		size_t n = end - start;
+		if (n == 2 && path[start] == '.' && path[start+1] == '.'){
+			if (dir != root) { dir = inodes[dir].parent; }
+			cacheable = cacheable && !descended;
+		} else if (n != 1 || path[start] != '.'){
+			descended = true;
+			if (n == 0 || n > 5) { return -1; }
+			char name[6] = {0};
+			memcpy(name, path + start, n);
+			std::shared_lock<std::shared_mutex> lock(dir_locks[dir]);
+			int child = dir_index.find(dir, name);
+			if (child == -1 || !isDir(child)) { return -1; }
+			dir = child;
 		}
+		start = end + 1;
 	}
-	return -1;
+	if (!cacheable) { return dir; }
+	if (session.dentries.size() >= MAX_DENTRIES) { session.dentries.clear(); }
+	Dentry dentry = { dir, incarnation[base], incarnation[dir] };
+	session.dentries[key] = dentry;
+	return dir;
 }
 
 /**
- * @brief Writes data to the mounted disk. Called after every write operation
+ * @brief Resolves the directory holding the last name of a path, as resolve_dir. A plain name is in the current
+ * working directory, without a lookup.
  *
- * @param disk_name - name of the disk to write to
+ * @param session - session running the command
+ * @param path - path of a file or directory
+ * @param leaf - set to the last name of the path
+ * @return Inode index of the directory, or -1 if the path does not lead to one
  */
-void write_to_disk(char *disk_name){
-	// update disk contents
-	ofstream fs;
-	fs.open(disk_name);
-	if(fs.fail()){ fprintf(stderr, "Error: Failure to write to disk %s\n", disk_name); }
-	else {
-		char block_buf[1024];
-		char buf[1];
-		fs.write(superblock->free_block_list, sizeof(superblock->free_block_list));
-		for(int i=0; i<126; i++){
-			fs.write( superblock->inode[i].name, 5);
-			buf[0] = superblock->inode[i].used_size;
-			fs.write( buf, 1);
-			buf[0] = superblock->inode[i].start_block;
-			fs.write( buf, 1);
-			buf[0] = superblock->inode[i].dir_parent;
-			fs.write( buf, 1);
-		}
-		for(int i=0; i<127; i++){
-			memcpy(block_buf, blocks[i].block, 1024);
-			fs.write(block_buf, 1024);
-		}
-		fs.close();
+int FileSystem::resolve_parent(Session &session, const char *path, const char **leaf){
+	const char *slash = strrchr(path, '/');
+	if (slash == NULL) { *leaf = path; return session.cwd; }
+	*leaf = slash + 1;
+	if (**leaf == '\0') { return -1; }
+	return resolve_dir(session, path, slash == path ? 1 : slash - path);
+}
+
+/**
+ * @brief Writes a byte range of the disk at the given offset from pieces of memory, with one positioned gather write
+ * retried on short writes. A memory-mapped disk already holds the data, so its pages covering the range are synced instead.
+ *
+ * @param pieces - bytes to write, in order, consumed by the call
+ * @param count - number of pieces
+ * @param offset - byte offset in the disk
+ * @return false if the write failed
+ */
+bool FileSystem::write_range(struct iovec *pieces, int count, off_t offset){
+	if (disk_map != NULL){
+		size_t len = 0;
+		for (int i=0; i<count; i++) { len += pieces[i].iov_len; }
+		off_t page = sysconf(_SC_PAGESIZE);
+		off_t first = offset - offset % page;
+		return msync(disk_map + first, len + (offset - first), MS_ASYNC) == 0;
 	}
+	while (count > 0){
+		ssize_t n = pwritev(disk_fd, pieces, std::min(count, IOV_MAX), offset);
+		if (n <= 0) { return false; }
+		offset += n;
+		for (; count > 0 && (size_t)n >= pieces->iov_len; pieces++, count--) { n -= pieces->iov_len; }
+		if (count > 0) { pieces->iov_base = (char *)pieces->iov_base + n; pieces->iov_len -= n; }
+	}
+	return true;
 }
 
 /**
- * @brief Function to mount the disk. Loads the disk superblock and performs six consistency checks and error handling. 
+ * @brief Writes the parts of the superblock and the data blocks that changed since the last write-back to the mounted disk.
+ * Changed inodes are encoded into the superblock first. Contiguous changed inodes and blocks are coalesced into a
+ * single positioned write, gathering blocks from their pages. With a journal, the changes of
+ * every command since the last write-back are first committed together as one transaction, and the disk is synced
+ * and the journal emptied once it grows past JOURNAL_CHECKPOINT_BYTES.
  *
- * @param new_disk_name - name of the disk to mount
+ * @param err - stream for write errors
+ * @return false if the disk could not be written
  */
-void fs_mount(char *new_disk_name){
-	if (strlen(disk)!=0) { write_to_disk(disk); }
-	dir_names.empty(); 
-	Super_block * loaded_superblock = new Super_block();
-	int constraint = 0;
-	ifstream fs;
-	fs.open(new_disk_name);
-	if(fs.fail()){ fprintf(stderr, "Error: Cannot find disk %s\n", new_disk_name); return; }
-	else {
-		fs.read(loaded_superblock->free_block_list, sizeof(loaded_superblock->free_block_list)); // load free block list
-		char buf[1];
-		for (int i=0; i<126; i++){
-			fs.read(loaded_superblock->inode[i].name, 5);
-			fs.read(buf, 1);
-			loaded_superblock->inode[i].used_size = buf[0];
-			fs.read(buf, 1);
-			loaded_superblock->inode[i].start_block = buf[0];
-			fs.read(buf, 1);
-			loaded_superblock->inode[i].dir_parent = buf[0];
-		}
-	}
-
-	// populates a free block list to check against list from loaded superblock
-	char free_block_check[16] = "";
-	for (int i=0; i<126; i++){
-		int size = loaded_superblock->inode[i].used_size & 127;
-		if ((loaded_superblock->inode[i].dir_parent & 128) == 0){
-			if(loaded_superblock->inode[i].start_block < 1 || loaded_superblock->inode[i].start_block > 127) { continue; };
-			for (int j = 0; j<size; j++){
-				unsigned char prev = free_block_check[(int)((loaded_superblock->inode[i].start_block+j)/8)];
-				unsigned char next = setBit(free_block_check[(int)((loaded_superblock->inode[i].start_block+j)/8)], ((loaded_superblock->inode[i].start_block+j)%8)+1, 1);
-				if(prev == next){ // to ensure multiple files are not allocated to the same block
-					constraint=1;
-				} else {
-					free_block_check[(int)((loaded_superblock->inode[i].start_block+j)/8)] = 
-					setBit(free_block_check[(int)((loaded_superblock->inode[i].start_block+j)/8)], ((loaded_superblock->inode[i].start_block+j)%8)+1, 1);
-				}
-			}
+bool FileSystem::write_to_disk(FILE *err){
+	if (disk_fd < 0) { return false; }
+	typedef struct {
+		const void *data;
+		size_t len;
+		off_t offset;
+	} Write_range;
+	std::vector<Write_range> ranges;
+	auto add_range = [&](const uint8_t *data, size_t len, off_t offset){ // merged with the last range when it follows it on disk and in memory
+		Write_range *last = ranges.empty() ? NULL : &ranges.back();
+		if (last != NULL && last->offset + (off_t)last->len == offset && (const uint8_t *)last->data + last->len == data) { last->len += len; }
+		else { ranges.push_back({ data, len, offset }); }
+	};
+	for (int block = dirty_blocks.next(first_data); !snapshots.empty() && block < dirty_blocks.size(); block = dirty_blocks.next(block+1)){
+		int pins = 0; // snapshots that left the block on disk keep its old contents before they are written over
+		for (size_t s=0; s<snapshots.size(); s++) { pins += snapshots[s].pages[block] == NOT_LOADED; }
+		if (pins == 0) { continue; }
+		int p = block_store.keep(block, pins);
+		for (size_t s=0; s<snapshots.size(); s++){
+			if (snapshots[s].pages[block] == NOT_LOADED) { snapshots[s].pages[block] = p; }
 		}
 	}
-	free_block_check[0] = setBit(free_block_check[0], 1, 1);
-
-	// if both lists don't match, disk is inconsistent
-	if (memcmp(free_block_check, loaded_superblock->free_block_list, 16)!=0) { constraint = 1; }
-
-	// second consistency check: names in same dir must be unique
-	if (constraint==0){
-		dir_names.clear();
-		for (int i=0; i<126; i++){
-			if((loaded_superblock->inode[i].used_size & 128)!=0){ // dont check free inodes
-				int parent = (loaded_superblock->inode[i].dir_parent & 127);
-				if(parent == 127){
-					if(dir_names.find(root)==dir_names.end()){ // if parent name does not exist in map of directory names and their indeces, create new entry
-						std::vector<int> index;
-						index.push_back(i);
-						dir_names[root] = index;
-					} else {
-						dir_names[root].push_back(i); // update list of indeces with same parent name
-					}
-				} else {
-					if(dir_names.find(loaded_superblock->inode[parent].name)==dir_names.end()){ // if parent name does not exist in dir map
-						std::vector<int> index;
-						index.push_back(i);
-						dir_names[loaded_superblock->inode[parent].name] = index;
-					} else {
-						dir_names[loaded_superblock->inode[parent].name].push_back(i); // update list of inodes indeces with the same parent name
-					}
-				}
-			}
-		}
+	// superblock: the header, the changed words of the free block list and the changed inodes
+	if (dirty_header) { add_range(meta, bitmap_offset(geometry), 0); }
+	for (int w = dirty_free_list.next(0); w < dirty_free_list.size(); w = dirty_free_list.next(w+1)){
+		off_t first = bitmap_offset(geometry) + (off_t)w*8;
+		add_range(meta + first, 8, first);
+	}
+	size_t inode_size = inode_bytes(geometry);
+	for (int i = dirty_inodes.next(0); i < dirty_inodes.size(); i = dirty_inodes.next(i+1)){
+		encode_inode(geometry, inodes[i], meta, i);
+		off_t first = inode_offset(geometry) + (off_t)i*inode_size;
+		add_range(meta + first, inode_size, first);
+	}
+	for (int block = dirty_blocks.next(first_data); block_checksums.enabled() && block < dirty_blocks.size(); block = dirty_blocks.next(block+1)){
+		off_t first = checksum_offset(geometry) + (off_t)block*4; // checksums change with their blocks
+		add_range(meta + first, 4, first);
+	}
+	for (int block = dirty_blocks.next(first_data); block < dirty_blocks.size(); block = dirty_blocks.next(block+1)){
+		add_range(block_store.read(block), geometry.block_size, (off_t)block*geometry.block_size); // flat blocks merge
+	}
 
-		std::map<char *, std::vector<int>>::iterator dir_it;
-		std::vector<char *> names; // each dir has vector of file names
-		for (dir_it = dir_names.begin(); dir_it != dir_names.end(); dir_it++ ){
-			names.clear();
-			std::vector<int> val = dir_it->second; // list of inode indeces belonging to that dir
-			names.push_back(loaded_superblock->inode[val.at(0)].name); // populate list of names
-			for (int i=1; i<(int)val.size(); i++){
-				for (int j=0; j<(int)names.size(); j++){
-					if (memcmp(loaded_superblock->inode[val.at(i)].name, names.at(j), 5)!=0){ // check new name against list of names
-						names.push_back(loaded_superblock->inode[val.at(i)].name); // if unique, add to list
-						break;
-					} else { constraint = 2; }
-				}
-			}
-		}
+	bool ok = true;
+	if (journal.is_open()){
+		for (size_t i=0; i<ranges.size(); i++) { journal.add(ranges[i].data, ranges[i].len, ranges[i].offset); }
+		ok = journal.commit();
+	}
+	std::vector<struct iovec> pieces(ranges.size());
+	for (size_t i=0; i<ranges.size(); i++) { pieces[i] = { (void *)ranges[i].data, ranges[i].len }; }
+	for (size_t i=0, end; ok && i<ranges.size(); i = end){ // ranges that follow each other on disk are written together
+		for (end = i+1; end < ranges.size() && ranges[end].offset == ranges[end-1].offset + (off_t)ranges[end-1].len; end++);
+		ok = write_range(&pieces[i], end - i, ranges[i].offset);
+		stats_add(STAT_DISK_WRITES, 1);
+	}
+	for (size_t i=0; ok && i<ranges.size(); i++) { stats_add(STAT_BYTES_WRITTEN, ranges[i].len); }
+	if (ok && journal.is_open() && journal.size() >= JOURNAL_CHECKPOINT_BYTES){
+		ok = fsync(disk_fd)==0 && journal.checkpoint();
 	}
+	if (!ok) { fprintf(err, "Error: Failure to write to disk %s\n", disk); return false; }
+	dirty_header = false;
+	dirty_free_list.clear();
+	dirty_inodes.clear();
+	dirty_blocks.clear();
+	pending_commands = 0;
+	std::vector<int> evicted;
+	block_store.trim(evicted); // every block in memory is now also on disk
+	for (size_t i=0; i<evicted.size(); i++) { block_checksums.forget(evicted[i]); } // verified again once loaded back
+	return true;
+}
 
-	if (constraint==0){
-	// third consistency check: if inode state is free, all bits must be zero, otherwise name will have at least one bit not zero
-		char name_mask[5] = "";
-		for (int i=0; i<126; i++){
-			if ((loaded_superblock->inode[i].used_size & 128)==0){
-				if (memcmp(loaded_superblock->inode[i].name, name_mask, 5)!=0 || loaded_superblock->inode[i].used_size!=0 || loaded_superblock->inode[i].start_block!=0 || loaded_superblock->inode[i].dir_parent!=0){
-					constraint = 3;
-				}
-			} else { if(memcmp(loaded_superblock->inode[i].name, name_mask, 5)==0){ constraint = 3; } }
-		}
+/**
+ * @brief Name of the clean-unmount marker of a disk
+ *
+ * @param disk_name - name of the disk
+ */
+std::string clean_marker_path(const char *disk_name){
+	return std::string(disk_name) + ".clean";
+}
+
+/**
+ * @brief Records that the mounted disk was fully written back and unmounted, with the checksum of its superblock.
+ * The marker is removed when the disk is next mounted, so it is missing after a crash.
+ */
+void FileSystem::write_clean_marker(void){
+	Clean_marker marker;
+	memcpy(marker.magic, CLEAN_MAGIC, 8);
+	marker.checksum = checksum64(meta, meta_bytes(geometry));
+	int fd = open(clean_marker_path(disk).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) { return; } // without a marker the next mount runs the full checks
+	if (write(fd, &marker, sizeof(marker)) != sizeof(marker)) { close(fd); unlink(clean_marker_path(disk).c_str()); return; }
+	close(fd);
+}
+
+/**
+ * @brief Checks if a disk was cleanly unmounted and its superblock has not been changed since
+ *
+ * @param disk_name - name of the disk
+ * @param sb - superblock loaded from the disk
+ * @param len - bytes of the superblock
+ * @return true if the consistency checks can be skipped
+ */
+bool is_clean(const char *disk_name, const uint8_t *sb, size_t len){
+	Clean_marker marker;
+	int fd = open(clean_marker_path(disk_name).c_str(), O_RDONLY);
+	if (fd < 0) { return false; }
+	bool clean = read(fd, &marker, sizeof(marker)) == sizeof(marker) && memcmp(marker.magic, CLEAN_MAGIC, 8)==0
+		&& marker.checksum == checksum64(sb, len);
+	close(fd);
+	return clean;
+}
+
+/**
+ * @brief Called after every command that may change the disk. Writes changes back according to the flush policy.
+ * A command that changed nothing, such as a read, is not counted and takes no exclusive lock, unless the blocks it
+ * loaded filled the cache.
+ *
+ * @param session - session that ran the command
+ */
+void FileSystem::persist(Session &session){
+	bool cache_full = block_store.over_capacity(); // blocks can only be evicted once written back
+	if (!cache_full){
+		std::shared_lock<std::shared_mutex> shared(disk_lock);
+		if (!dirty_header && dirty_free_list.empty() && dirty_inodes.empty() && dirty_blocks.empty()) { return; }
 	}
-				
-	// fourth consistency check: start block of every inode marked as a file must have a value between 1 and 127
-	if (constraint==0){
-		for (int i=0; i<126; i++){
-			if((loaded_superblock->inode[i].dir_parent & 128)==0 && (loaded_superblock->inode[i].used_size & 128)!=0){ // file and in use
-				if ((loaded_superblock->inode[i].start_block & 127)==0 || (loaded_superblock->inode[i].start_block & 128)==128){
-					constraint = 4;
-				}
-			}
-		}
+	int pending = ++pending_commands;
+	if (options.flush_policy == FLUSH_ALWAYS || (options.flush_policy == FLUSH_EVERY_N && pending >= options.flush_interval) || cache_full){
+		std::unique_lock<std::shared_mutex> lock(disk_lock);
+		if (pending_commands > 0 && mounted) { write_to_disk(session.err); } // another session may have written back first
 	}
+}
 
-	// fifth consistency check: size and startblock of dir must be marked as zero
-	if (constraint==0){
-		for (int i=0; i<126; i++){
-			if((loaded_superblock->inode[i].dir_parent & 128)!=0){
-				if((loaded_superblock->inode[i].used_size & 127)!=0 || (loaded_superblock->inode[i].start_block & 255)!=0){
-					constraint = 5;
-				}
-			}
-		}
+/**
+ * @brief Writes back any pending changes and releases the mounted disk, marking it clean if every change reached it
+ */
+void FileSystem::unmount(void){
+	if (strlen(disk)==0) { return; }
+	bool clean = write_to_disk(err);
+	if (disk_map != NULL) { clean = msync(disk_map, disk_bytes(geometry), MS_SYNC)==0 && clean; }
+	if (journal.is_open()){
+		clean = fsync(disk_fd)==0 && clean;
+		journal.close(clean); // the journal is kept for replay if the disk may be missing a transaction
+	}
+	if (clean) { write_clean_marker(); }
+	drop_snapshots();
+	if (disk_map != NULL){
+		munmap(disk_map, disk_bytes(geometry));
+		disk_map = NULL;
+		meta_buffer.assign(meta_bytes(geometry), 0);
+		meta = meta_buffer.data();
 	}
+	block_store.attach_paged(geometry.num_blocks, geometry.block_size, options.dedup); // no longer backed by the disk
+	block_checksums.attach(NULL, 0, 0);
+	close(disk_fd);
+	disk_fd = -1;
+	disk[0] = '\0';
+	mounted = false;
+}
 
-	// sixth consistency check: index of parent inode cannot be 126 and must be in use and a dir
-	if (constraint==0){
-		for (int i=0; i<126; i++){
-			if ((loaded_superblock->inode[i].used_size & 128)!=0){
-				unsigned char dir = (loaded_superblock->inode[i].dir_parent & 127);
-				if (dir == 126){
-					constraint = 6;
-				} else if (dir >= 0 && dir < 126) {
-				 	if ((loaded_superblock->inode[dir].dir_parent & 128)==0 || (loaded_superblock->inode[dir].used_size & 128)==0){ constraint = 6; }
-				}
-			}
-		}
+/**
+ * @brief Maps a whole disk into memory. Only the superblock may be accessed until a short disk is grown.
+ *
+ * @param fd - open file descriptor of the disk
+ * @param geometry - geometry of the disk
+ * @return The mapping, or NULL if the disk is shorter than its superblock or cannot be mapped
+ */
+uint8_t * map_disk(int fd, const Geometry &geometry){
+	struct stat st;
+	if (fstat(fd, &st)!=0 || st.st_size < (off_t)meta_bytes(geometry)) { return NULL; }
+	void *map = mmap(NULL, disk_bytes(geometry), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return map == MAP_FAILED ? NULL : (uint8_t *)map;
+}
+
+/**
+ * @brief Function to mount the disk. Loads the disk superblock and performs six consistency checks and error handling.
+ * The checks are skipped when the disk was cleanly unmounted and its superblock still matches the checksum recorded then.
+ *
+ * @param session - session mounting the disk, its working directory becomes root
+ * @param new_disk_name - name of the disk to mount
+ * @param policy - allocation policy of the disk
+ */
+/**
+ * @brief Checks if a path names the file open as a descriptor, whatever path it was opened by
+ *
+ * @param fd - open file descriptor
+ * @param name - path of a file
+ */
+static bool same_file(int fd, const char *name){
+	struct stat open_st, named_st;
+	return fstat(fd, &open_st)==0 && stat(name, &named_st)==0 && open_st.st_dev==named_st.st_dev && open_st.st_ino==named_st.st_ino;
+}
+
+void FileSystem::fs_mount(Session &session, char *new_disk_name, Alloc_policy policy){
+	std::unique_lock<std::shared_mutex> lock(disk_lock);
+	if (options.shared && mounted && same_file(disk_fd, new_disk_name)) { session.cwd = root; return; } // join the disk other sessions use, by any of its names
+	if (strlen(disk)!=0) { write_to_disk(session.err); }
+	if (Journal::replay(new_disk_name) < 0) { fprintf(session.err, "Error: Failure to write to disk %s\n", new_disk_name); } // redo transactions lost by a crash
+	Geometry new_geometry;
+	uint8_t * loaded_meta; // superblock as on disk
+	std::vector<uint8_t> loaded_buffer;
+	int constraint = 0;
+	int new_fd = -1;
+	uint8_t * new_map = NULL;
+	ifstream fs;
+	if (options.use_mmap){ // the mapped superblock is checked and used in place
+		new_fd = open(new_disk_name, O_RDWR);
+		if (new_fd < 0){ fprintf(session.err, "Error: Cannot find disk %s\n", new_disk_name); return; }
+		if (!read_geometry(new_fd, &new_geometry)){ fprintf(session.err, "Error: Disk %s has an invalid geometry\n", new_disk_name); close(new_fd); return; }
+		new_map = map_disk(new_fd, new_geometry);
+		if (new_map == NULL){ fprintf(session.err, "Error: Cannot find disk %s\n", new_disk_name); close(new_fd); return; }
+		loaded_meta = new_map;
+	} else {
+		fs.open(new_disk_name);
+		if(fs.fail()){ fprintf(session.err, "Error: Cannot find disk %s\n", new_disk_name); return; }
+		uint8_t header[sizeof(Geometry_header)] = {0};
+		fs.read((char *)header, sizeof(header));
+		fs.clear();
+		fs.seekg(0);
+		if (!parse_geometry_header(header, &new_geometry)){ fprintf(session.err, "Error: Disk %s has an invalid geometry\n", new_disk_name); return; }
+		loaded_buffer.assign(meta_bytes(new_geometry), 0);
+		fs.read((char *)loaded_buffer.data(), loaded_buffer.size()); // load free block list and inodes, a short disk reads as zeroes
+		loaded_meta = loaded_buffer.data();
+	}
+	std::vector<Inode> loaded_inodes(new_geometry.num_inodes);
+	decode_inodes(new_geometry, loaded_meta, loaded_inodes.data());
+
+	std::vector<Violation> violations;
+	if (is_clean(new_disk_name, loaded_meta, meta_bytes(new_geometry))) { build_dir_index(new_geometry, loaded_inodes, loaded_index); } // unchanged since a clean unmount
+	else { constraint = check_superblock(new_geometry, loaded_meta + bitmap_offset(new_geometry), loaded_inodes, loaded_index, violations); } // six consistency checks, also builds the directory index
+	for (int i=0; options.verbose && i<(int)violations.size(); i++){
+		if (violations[i].inode < 0) { fprintf(session.err, "Error: File system in %s: %s (error code: %i)\n", new_disk_name, violations[i].message.c_str(), violations[i].code); }
+		else { fprintf(session.err, "Error: File system in %s: inode %d: %s (error code: %i)\n", new_disk_name, violations[i].inode, violations[i].message.c_str(), violations[i].code); }
+	}
+
+	struct stat st;
+	if (constraint==0 && new_fd < 0){
+		new_fd = open(new_disk_name, O_RDWR);
+		if (new_fd < 0) { fprintf(session.err, "Error: Failure to write to disk %s\n", new_disk_name); constraint = -1; }
+	}
+	if (constraint==0 && (fstat(new_fd, &st)!=0 || (st.st_size < (off_t)disk_bytes(new_geometry) && ftruncate(new_fd, disk_bytes(new_geometry))!=0))){
+		fprintf(session.err, "Error: Failure to write to disk %s\n", new_disk_name); constraint = -1; // a short disk is grown with zeroed blocks
 	}
 
 	if(constraint!=0){ // Error handling
-		fprintf(stderr, "Error: File system in %s is inconsistent (error code: %i)\n", new_disk_name, constraint);
-		if(strlen(disk)==0){ fprintf(stderr, "Error: No file system is mounted\n"); }
+		if (constraint > 0) { fprintf(session.err, "Error: File system in %s is inconsistent (error code: %i)\n", new_disk_name, constraint); }
+		if(strlen(disk)==0){ fprintf(session.err, "Error: No file system is mounted\n"); }
+		if (new_map != NULL) { munmap(new_map, disk_bytes(new_geometry)); }
+		if (new_fd >= 0) { close(new_fd); }
 	} else { // load superblock, set mounted disk name and set current working directory to root
-		char block_buffer[1024];
+		unmount();
+		unlink(clean_marker_path(new_disk_name).c_str()); // the disk may change from here on, a crash must not leave it marked clean
+		disk_fd = new_fd;
 		strcpy(disk, new_disk_name);
-		superblock = loaded_superblock;
-		for(int i=0; i<127; i++){ // copy disk data blocks
-			fs.read(block_buffer, 1024);
-			memcpy(blocks[i].block, block_buffer, 1024);
+		if (options.use_journal && !journal.open(disk)) { fprintf(session.err, "Error: Cannot create journal for disk %s\n", disk); }
+		set_geometry(new_geometry);
+		if (new_map != NULL){ // superblock and data blocks are used directly from the mapping
+			disk_map = new_map;
+			meta = new_map;
+			meta_buffer.clear();
+			block_store.attach_flat(new_map, geometry.block_size);
+		} else {
+			meta_buffer.swap(loaded_buffer);
+			meta = meta_buffer.data();
+			block_store.attach_paged(geometry.num_blocks, geometry.block_size, options.dedup, disk_fd); // data blocks are loaded on first access
 		}
-		cwd = 127;
+		inodes.swap(loaded_inodes);
+		block_allocator.attach((char *)meta + bitmap_offset(geometry), geometry.num_blocks);
+		block_allocator.set_policy(policy);
+		block_checksums.attach(geometry.checksums ? meta + checksum_offset(geometry) : NULL, geometry.num_blocks, geometry.block_size);
+		defrag_budget = 0;
+		std::swap(dir_index, loaded_index);
+		build_usage();
+		pending_commands = 0;
+		mounted = true;
+		for (int i=0; i<(int)sessions.size(); i++) { sessions[i]->cwd = root; }
+		session.cwd = root;
 	}
-	fs.close();
+	if (fs.is_open()) { fs.close(); }
 
 }
 
 /**
- * @brief Function to create a new file or directory (if size is 0) in the current working directory
+ * @brief Function to create a new file or directory (if size is 0) in the current working directory, or in the
+ * directory leading to it
  *
- * @param name - file/directory name
+ * @param session - session running the command
+ * @param path - file/directory name, or its path
  * @param size - file size
  */
-void fs_create(char name[5], int size){
-	int index = 127;
+void FileSystem::fs_create(Session &session, const char *path, int size){
+	std::shared_lock<std::shared_mutex> disk_shared(disk_lock);
+	const char *name;
+	int parent = resolve_parent(session, path, &name);
+	if (parent == -1) { fprintf(session.err, "Error: Directory %.*s does not exist\n", (int)(name - path - 1), path); return; }
+	std::unique_lock<std::shared_mutex> dir(dir_locks[parent]);
+	std::lock_guard<std::mutex> alloc(alloc_lock); // the first free inode and blocks must stay free until they are taken
+	int index = find_free_inode(); // use the first available inode
 	int exists = -1;
-	bool space = 0;
-	for (int i=0; i<126; i++){
-		if (superblock->inode[i].used_size<128){ //inode is available
-			index = i;
-			break; // use the first available inode
-		}
-	}
-	if (index == 127) { fprintf(stderr, "Error: Superblock in disk %s is full, cannot create %s\n", disk, name); return; }
+	if (index == -1) { fprintf(session.err, "Error: Superblock in disk %s is full, cannot create %s\n", disk, path); return; }
 	else {
-		if (cwd == 127){ exists = check_dir_names(root, name); } 
-		else { exists = check_dir_names(superblock->inode[cwd].name, name); } // check if filename exists in the current working directory
-		if (exists!=-1) { fprintf(stderr, "Error: File or directory %s already exists\n", name); }
+		exists = dir_index.find(parent, name); // check if filename exists in the directory
+		if (exists!=-1) { fprintf(session.err, "Error: File or directory %s already exists\n", path); }
 		else { //create the file or dir
 			clear_inode(index);
 			if (size == 0) { // create dir
-				memcpy(superblock->inode[index].name, name, 5);
-				superblock->inode[index].used_size = 128;
-				superblock->inode[index].dir_parent = (cwd | 128);
-				dir_names.insert(std::pair<char *,std::vector<int>>(name, std::vector<int>()));
+				memcpy(inodes[index].name, name, strnlen(name, 5)); // the cleared inode pads the name with zeroes
+				inodes[index].in_use = true;
+				inodes[index].is_dir = true;
+				inodes[index].parent = parent;
+				clear_usage(index);
+				add_usage(parent, 0, 0, 1);
 			} else { //check free block list to create file
-				int count = 0;
-				int block = 0; 
-				int start_block = 0;
-				for (int i=0; i<16; i++){ // check contiguous free blocks in free block list of size 
-					for (int j=0; j<8; j++){
-						if (!(superblock->free_block_list[i] >> (7-j)) & 1) { count +=1; } else { count = 0; }
-						block +=1;
-						if (count == size ) { space = true; start_block = block-size+1; break; } // found space
-					}
-				}
-				if (!space) { fprintf(stderr, "Error: Cannot allocate %i KB on %s\n", size, disk); }
+				int start_block = block_allocator.find_run(size);
+				if (start_block == -1) { fprintf(session.err, "Error: Cannot allocate %i KB on %s\n", size, disk); return; }
 				else {
 					// set inode attributes
-					memcpy(superblock->inode[index].name, name, 5);
-					superblock->inode[index].used_size = size | 128;
-					superblock->inode[index].dir_parent = cwd;
-					superblock->inode[index].start_block = start_block;
-					for(int j=0; j<size; j++){ // update free block list
-						superblock->free_block_list[(int)((start_block+j)/8)] = setBit(superblock->free_block_list[(int)((start_block+j)/8)], ((start_block+j)%8)+1, 1);
-					}
+					memcpy(inodes[index].name, name, strnlen(name, 5));
+					inodes[index].in_use = true;
+					inodes[index].size = size;
+					inodes[index].parent = parent;
+					inodes[index].start_block = start_block;
+					set_blocks_state(start_block, size, 1); // update free block list
+					add_usage(parent, size, 1, 0);
 				}
 			}
-			// update map of parent directories to include new inode
-			if ( cwd==127 ){ dir_names[root].push_back(index); }  else { dir_names[superblock->inode[cwd].name].push_back(index); }
+			dirty_inodes.add(index);
+			dir_index.add(parent, index, inodes[index].name); // update index of the directory to include new inode
+		}
+	}
+}
+
+/**
+ * @brief Releases the growth headroom reserved after a file
+ *
+ * @param index - Inode index
+ */
+void FileSystem::release_headroom(int index){
+	if (headroom[index] == 0) { return; }
+	block_allocator.reserve_run(inodes[index].start_block + inodes[index].size, headroom[index], false);
+	headroom[index] = 0;
+}
 
+/**
+ * @brief Number of blocks of headroom the growth policy wants after a file that grew to the given size
+ *
+ * @param size - new file size
+ */
+int FileSystem::wanted_headroom(int size){
+	int capacity = std::min(size*options.growth_factor + options.growth_blocks, max_file_blocks(geometry)); // legacy inodes hold at most 127 blocks
+	return std::max(capacity - size, 0);
+}
+
+/**
+ * @brief Reserves the free blocks directly after a file, up to the headroom wanted by the growth policy
+ *
+ * @param index - Inode index
+ */
+void FileSystem::reserve_headroom(int index){
+	int end = inodes[index].start_block + inodes[index].size;
+	int wanted = wanted_headroom(inodes[index].size);
+	headroom[index] = std::min(wanted, block_allocator.next_claimed(end) - end); // stops at the headroom of the next file
+	block_allocator.reserve_run(end, headroom[index], true);
+}
+
+/**
+ * @brief Adds to the usage of a directory and of every directory above it. The caller holds the directory
+ * exclusively; directories above it may be changed by other sessions at the same time, so the counters are atomic.
+ *
+ * @param dir - inode index of the directory
+ * @param blocks - blocks to add
+ * @param files - files to add
+ * @param dirs - directories to add
+ */
+void FileSystem::add_usage(int dir, int64_t blocks, int files, int dirs){
+	for (int d = dir; ; d = inodes[d].parent){
+		usage[d].blocks += blocks;
+		usage[d].files += files;
+		usage[d].dirs += dirs;
+		if (d == root) { break; }
+	}
+}
+
+/**
+ * @brief Zeroes the usage of a directory, which is new or deleted
+ *
+ * @param dir - inode index of the directory
+ */
+void FileSystem::clear_usage(int dir){
+	usage[dir].blocks = 0;
+	usage[dir].files = 0;
+	usage[dir].dirs = 0;
+}
+
+/**
+ * @brief Computes the usage of every directory from the directory index in one pass: directories are listed from
+ * root down, then summed up from the deepest. The caller holds the disk exclusively.
+ */
+void FileSystem::build_usage(void){
+	std::vector<int> order(1, root);
+	for (size_t d=0; d<order.size(); d++){
+		clear_usage(order[d]);
+		const std::vector<int> &children = dir_index.children(order[d]);
+		for (int i=0; i<(int)children.size(); i++){
+			if (isDir(children[i])) { order.push_back(children[i]); }
+		}
+	}
+	for (size_t d=order.size(); d-- > 0; ){
+		int dir = order[d];
+		const std::vector<int> &children = dir_index.children(dir);
+		for (int i=0; i<(int)children.size(); i++){
+			int child = children[i];
+			if (!isDir(child)) { usage[dir].blocks += inodes[child].size; usage[dir].files++; continue; }
+			usage[dir].blocks += usage[child].blocks;
+			usage[dir].files += usage[child].files;
+			usage[dir].dirs += usage[child].dirs + 1;
 		}
 	}
 }
 
 /**
- * @brief Function to delete a file or directory and its files recursively, within the current working directory
+ * @brief Deletes a file and removes it from its parent directory
  *
- * @param name - file/directory name
+ * @param index - Inode index
  */
-void fs_delete(char name[5]){
-	int exists = -1;
-	char * dir;
-	if (cwd==127) { dir = root; } else { dir = superblock->inode[cwd].name; }
-	exists = check_dir_names(dir, name);
-	if (exists == -1) { fprintf(stderr, "Error: File or directory %s does not exist\n", name); }
-	else {
-		if(isDir(exists)){ // if name is a dir
-			for(int i=0; i<(int)dir_names[name].size(); i++){ // delete its children recursively
-				fs_delete(superblock->inode[dir_names[name].at(i)].name);
-			}
-			dir_names.erase(name); // remove from map of directory names
-			clear_inode(exists);
-		} else {
-			for (int i=0; i<(superblock->inode[exists].used_size & 127); i++){ // update free block list and clear blocks
-				superblock->free_block_list[(int)((superblock->inode[exists].start_block+i)/8)] = setBit(superblock->free_block_list[(int)((superblock->inode[exists].start_block+i)/8)], ((superblock->inode[exists].start_block+i)%8)+1, 0);
-				clear_block(superblock->inode[exists].start_block+i);
-			}
-			for (int j=0; j<(int)dir_names[dir].size(); j++){ // update map of directory names
-				if (dir_names[dir].at(j) == exists) { dir_names[dir].erase(dir_names[dir].begin()+j); }
-			}
-			clear_inode(exists);
+void FileSystem::delete_file(int index){
+	release_headroom(index);
+	// update free block list and clear blocks
+	set_blocks_state(inodes[index].start_block, inodes[index].size, 0);
+	clear_blocks(inodes[index].start_block, inodes[index].size);
+	add_usage(inodes[index].parent, -inodes[index].size, -1, 0);
+	dir_index.remove(inodes[index].parent, index, inodes[index].name);
+	clear_inode(index);
+}
+
+/**
+ * @brief Deletes a directory and everything below it in one walk of the directory index, and removes it from its
+ * parent directory. The extents of its files are freed in order of start block with adjacent extents merged, so
+ * every run of the free block list is changed once, and the index entries of the deleted directories are dropped
+ * whole instead of child by child. The caller holds the disk exclusively.
+ *
+ * @param index - Inode index of the directory
+ * @param deleted - receives the directories deleted
+ */
+void FileSystem::delete_tree(int index, std::vector<int> &deleted){
+	std::vector<std::pair<int, int>> extents; // start block and size of every file
+	std::vector<int> files;
+	size_t first = deleted.size();
+	deleted.push_back(index);
+	for (size_t d=first; d<deleted.size(); d++){ // breadth first, deleted grows with the directories found
+		const std::vector<int> &children = dir_index.children(deleted[d]);
+		for (int i=0; i<(int)children.size(); i++){
+			int child = children[i];
+			if (isDir(child)) { deleted.push_back(child); continue; }
+			release_headroom(child);
+			if (inodes[child].size > 0) { extents.push_back(std::make_pair(inodes[child].start_block, inodes[child].size)); }
+			files.push_back(child);
+		}
+	}
+	std::sort(extents.begin(), extents.end());
+	for (size_t i=0; i<extents.size(); ){
+		int start = extents[i].first;
+		int end = start + extents[i].second;
+		for (i++; i<extents.size() && extents[i].first == end; i++) { end += extents[i].second; }
+		set_blocks_state(start, end-start, 0);
+		clear_blocks(start, end-start);
+	}
+	const Dir_usage &removed = usage[index];
+	add_usage(inodes[index].parent, -removed.blocks, -removed.files, -removed.dirs - 1);
+	dir_index.remove(inodes[index].parent, index, inodes[index].name);
+	for (size_t d=first; d<deleted.size(); d++){
+		incarnation[deleted[d]]++;
+		dir_index.drop(deleted[d]);
+		clear_usage(deleted[d]);
+		clear_inode(deleted[d]);
+	}
+	for (size_t i=0; i<files.size(); i++) { clear_inode(files[i]); }
+}
+
+/**
+ * @brief Function to delete a file or directory and its files recursively, within the current working directory or
+ * the directory leading to it
+ *
+ * @param session - session running the command
+ * @param path - file/directory name, or its path
+ */
+void FileSystem::fs_delete(Session &session, const char *path){
+	std::vector<int> deleted;
+	const char *name;
+	std::shared_lock<std::shared_mutex> disk_shared(disk_lock);
+	{
+		int parent = resolve_parent(session, path, &name);
+		if (parent == -1) { fprintf(session.err, "Error: File or directory %s does not exist\n", path); return; }
+		std::unique_lock<std::shared_mutex> dir(dir_locks[parent]);
+		int exists = dir_index.find(parent, name);
+		if (exists == -1) { fprintf(session.err, "Error: File or directory %s does not exist\n", path); return; }
+		if (!isDir(exists)){
+			std::unique_lock<std::shared_mutex> file(file_locks[exists]);
+			std::lock_guard<std::mutex> alloc(alloc_lock);
+			delete_file(exists);
+			return;
 		}
 	}
+	// a directory may hold anything below it, including the working directory of other sessions
+	disk_shared.unlock();
+	std::unique_lock<std::shared_mutex> disk_exclusive(disk_lock);
+	int parent = resolve_parent(session, path, &name); // look again, the directory may have changed while unlocked
+	int exists = parent == -1 ? -1 : dir_index.find(parent, name);
+	if (exists == -1) { fprintf(session.err, "Error: File or directory %s does not exist\n", path); return; }
+	if (!isDir(exists)) { delete_file(exists); return; }
+	delete_tree(exists, deleted);
+	for (int i=0; i<(int)sessions.size(); i++){
+		if (std::find(deleted.begin(), deleted.end(), sessions[i]->cwd) != deleted.end()) { sessions[i]->cwd = root; }
+	}
 }
 
 /**
  * @brief Function to read from a specified block from a file and writes the data into the buffer
  *
- * @param name - file name
+ * @param session - session running the command
+ * @param path - file name, or its path
  * @param block_num - the nth block of the file
  */
-void fs_read(char name[5], int block_num){
+void FileSystem::fs_read(Session &session, const char *path, int block_num){
+	std::shared_lock<std::shared_mutex> disk_shared(disk_lock);
+	const char *name;
+	int parent = resolve_parent(session, path, &name);
+	if (parent == -1) { fprintf(session.err, "Error: File %s does not exist\n", path); return; }
+	std::shared_lock<std::shared_mutex> dir(dir_locks[parent]);
 	int exists = -1;
-	if (cwd==127) { exists = check_dir_names(root, name); }
-	else { exists = check_dir_names(superblock->inode[cwd].name, name); }
-	if (exists==-1){ fprintf(stderr, "Error: File %s does not exist\n", name);}
-	else if (isDir(exists)){ fprintf(stderr, "Error: File %s does not exist\n", name);}
+	exists = dir_index.find(parent, name);
+	if (exists==-1){ fprintf(session.err, "Error: File %s does not exist\n", path);}
+	else if (isDir(exists)){ fprintf(session.err, "Error: File %s does not exist\n", path);}
 	else {
-		if ( block_num > ((superblock->inode[exists].used_size & 127)-1) || block_num < 0){
-			fprintf(stderr, "Error: %s does not have block %i\n", name, block_num);
+		if ( block_num > (inodes[exists].size-1) || block_num < 0){
+			fprintf(session.err, "Error: %s does not have block %i\n", path, block_num);
 		} else { 
-			memcpy(buffer, blocks[superblock->inode[exists].start_block + block_num].block, 1024);
+			std::shared_lock<std::shared_mutex> file(file_locks[exists]);
+			int block = inodes[exists].start_block + block_num;
+			const uint8_t *data = block_store.read(block);
+			if (!block_checksums.verify(block, data)) { fprintf(session.err, "Error: Checksum mismatch in block %i of %s\n", block_num, path); }
+			else { memcpy(session.buffer, data, geometry.block_size); }
 		}
 	}
 }
@@ -413,274 +856,1094 @@ void fs_read(char name[5], int block_num){
 /**
  * @brief Function to write the contents of the data buffer to a specified block of a file
  *
- * @param name - file name
+ * @param session - session running the command
+ * @param path - file name, or its path
  * @param block_num - the nth block of the file
  */
-void fs_write(char name[5], int block_num){
+void FileSystem::fs_write(Session &session, const char *path, int block_num){
+	std::shared_lock<std::shared_mutex> disk_shared(disk_lock);
+	const char *name;
+	int parent = resolve_parent(session, path, &name);
+	if (parent == -1) { fprintf(session.err, "Error: File %s does not exist\n", path); return; }
+	std::shared_lock<std::shared_mutex> dir(dir_locks[parent]);
 	int exists = -1;
-	if (cwd==127) { exists = check_dir_names(root, name); }
-	else { exists = check_dir_names(superblock->inode[cwd].name, name); }
-	if (exists==-1){ fprintf(stderr, "Error: File %s does not exist\n", name);}
-	else if (isDir(exists)){ fprintf(stderr, "Error: File %s does not exist, with index %i\n", name, exists);}
+	exists = dir_index.find(parent, name);
+	if (exists==-1){ fprintf(session.err, "Error: File %s does not exist\n", path);}
+	else if (isDir(exists)){ fprintf(session.err, "Error: File %s does not exist, with index %i\n", path, exists);}
 	else {
-		if ( block_num > ((superblock->inode[exists].used_size & 127)-1) || block_num < 0){
-			fprintf(stderr, "Error: %s does not have block %i\n", name, block_num);
+		if ( block_num > (inodes[exists].size-1) || block_num < 0){
+			fprintf(session.err, "Error: %s does not have block %i\n", path, block_num);
 		} else { 
-			memcpy(blocks[superblock->inode[exists].start_block + block_num].block, buffer, 1024);
+			std::unique_lock<std::shared_mutex> file(file_locks[exists]);
+			block_store.store(inodes[exists].start_block + block_num, session.buffer);
+			block_checksums.update(inodes[exists].start_block + block_num, session.buffer);
+			dirty_blocks.add(inodes[exists].start_block + block_num);
 		}
 	}
 }
 
 /**
- * @brief Populates the buffer with given data
+ * @brief Function to read a range of blocks of a file in one copy, into the session's staging buffer or straight to a
+ * host file
  *
- * @param buff - data buffer with contents to write into the file system buffer
+ * @param session - session running the command
+ * @param path - file name, or its path
+ * @param first - first block of the range
+ * @param last - block past the end of the range
+ * @param host - host file to write the blocks to, or NULL to keep them in the staging buffer
  */
-void fs_buff(uint8_t buff[1024]){
-	uint8_t b[1024] = "";
-	memcpy(buffer, b, sizeof(b));
-	memcpy(buffer, buff, 1024);
+void FileSystem::fs_read_range(Session &session, const char *path, int first, int last, const char *host){
+	std::shared_lock<std::shared_mutex> disk_shared(disk_lock);
+	const char *name;
+	int parent = resolve_parent(session, path, &name);
+	if (parent == -1) { fprintf(session.err, "Error: File %s does not exist\n", path); return; }
+	std::shared_lock<std::shared_mutex> dir(dir_locks[parent]);
+	int exists = dir_index.find(parent, name);
+	if (exists==-1 || isDir(exists)){ fprintf(session.err, "Error: File %s does not exist\n", path); return; }
+	if (last > inodes[exists].size){
+		fprintf(session.err, "Error: %s does not have block %i\n", path, last-1);
+		return;
+	}
+	std::shared_lock<std::shared_mutex> file(file_locks[exists]);
+	int start = inodes[exists].start_block + first;
+	size_t block_size = geometry.block_size;
+	for (int b=0; b<last-first; b++){ // nothing is copied from a damaged range
+		if (!block_checksums.verify(start + b, block_store.read(start + b))){
+			fprintf(session.err, "Error: Checksum mismatch in block %i of %s\n", first + b, path);
+			return;
+		}
+	}
+	if (host == NULL){
+		session.staging.resize((size_t)(last - first) * block_size);
+		for (int b=0; b<last-first; b++) { memcpy(session.staging.data() + b*block_size, block_store.read(start + b), block_size); }
+		return;
+	}
+	FILE *out = fopen(host, "wb");
+	bool ok = out != NULL;
+	for (int b=0; ok && b<last-first; b++) { ok = fwrite(block_store.read(start + b), 1, block_size, out) == block_size; }
+	if (out != NULL && fclose(out) != 0) { ok = false; }
+	if (!ok) { fprintf(session.err, "Error: Cannot write host file %s\n", host); }
 }
 
 /**
- * @brief Function to print out files and directories located in the current working directory. Files will display its size and
- *  directories will display its number of children.
+ * @brief Function to write a range of blocks of a file in one copy, from the session's staging buffer or straight
+ * from a host file. Blocks past the end of the data given are zeroed.
+ *
+ * @param session - session running the command
+ * @param path - file name, or its path
+ * @param first - first block of the range
+ * @param last - block past the end of the range
+ * @param host - host file to read the blocks from, or NULL to use the staging buffer
  */
-void fs_ls(void){
+void FileSystem::fs_write_range(Session &session, const char *path, int first, int last, const char *host){
+	std::shared_lock<std::shared_mutex> disk_shared(disk_lock);
+	const char *name;
+	int parent = resolve_parent(session, path, &name);
+	if (parent == -1) { fprintf(session.err, "Error: File %s does not exist\n", path); return; }
+	std::shared_lock<std::shared_mutex> dir(dir_locks[parent]);
+	int exists = dir_index.find(parent, name);
+	if (exists==-1 || isDir(exists)){ fprintf(session.err, "Error: File %s does not exist\n", path); return; }
+	if (last > inodes[exists].size){
+		fprintf(session.err, "Error: %s does not have block %i\n", path, last-1);
+		return;
+	}
+	FILE *in = NULL;
+	if (host != NULL && (in = fopen(host, "rb")) == NULL){
+		fprintf(session.err, "Error: Cannot read host file %s\n", host);
+		return;
+	}
+	std::unique_lock<std::shared_mutex> file(file_locks[exists]);
+	int start = inodes[exists].start_block + first;
+	size_t block_size = geometry.block_size;
+	uint8_t data[MAX_BLOCK_SIZE];
+	for (int b=0; b<last-first; b++){
+		size_t given = 0;
+		if (in != NULL) { given = fread(data, 1, block_size, in); }
+		else if (session.staging.size() > b*block_size) {
+			given = std::min(block_size, session.staging.size() - b*block_size);
+			memcpy(data, session.staging.data() + b*block_size, given);
+		}
+		memset(data + given, 0, block_size - given);
+		block_store.store(start + b, data);
+		block_checksums.update(start + b, data);
+		dirty_blocks.add(start + b);
+	}
+	if (in != NULL) { fclose(in); }
+}
+
+/**
+ * @brief Populates the buffer with given data, zeroing the rest of it
+ *
+ * @param session - session running the command
+ * @param data - data to write into the file system buffer
+ * @param len - bytes of data, at most MAX_BLOCK_SIZE are used
+ */
+void FileSystem::fs_buff(Session &session, const uint8_t *data, size_t len){
+	memset(session.buffer, 0, sizeof(session.buffer));
+	memcpy(session.buffer, data, std::min(len, sizeof(session.buffer)));
+}
+
+/**
+ * @brief Function to print out files and directories located in the current working directory, or the directory a
+ * path leads to. Files will display its size and directories will display its number of children.
+ *
+ * @param session - session running the command
+ * @param path - path of the directory to list, or NULL for the current working directory
+ */
+void FileSystem::fs_ls(Session &session, const char *path){
+	std::shared_lock<std::shared_mutex> disk_shared(disk_lock);
+	int listed = path == NULL ? session.cwd : resolve_dir(session, path, strlen(path));
+	if (listed == -1) { fprintf(session.err, "Error: Directory %s does not exist\n", path); return; }
+	int parent = listed == root ? root : inodes[listed].parent;
+	std::shared_lock<std::shared_mutex> parent_dir(dir_locks[parent], std::defer_lock);
+	if (parent != listed) { parent_dir.lock(); } // parent before child
+	std::shared_lock<std::shared_mutex> dir(dir_locks[listed]);
 	int index;
-	char * cwd_name;
 	int parent_child;
-	int child;
-	if (cwd == 127 ) {
-		cwd_name = root;
-		child = dir_names[cwd_name].size();
-		parent_child = child;
-	} else {
-		cwd_name = superblock->inode[cwd].name;
-		int parent = (superblock->inode[cwd].dir_parent & 127);
-		if (parent==127){ parent_child = dir_names[root].size(); } else { parent_child = dir_names[superblock->inode[parent].name].size(); }
-		child = dir_names[superblock->inode[cwd].name].size();
-	}
-	printf(".       %3d\n", child);
-	printf("..      %3d\n", parent_child);
-	for (int i=0; i<(int)dir_names[cwd_name].size(); i++){
-		index = dir_names[cwd_name].at(i);
+	int child = dir_index.size(listed);
+	if (listed == root) { parent_child = child; }
+	else { parent_child = dir_index.size(parent); }
+	fprintf(session.out, ".       %3d\n", child);
+	fprintf(session.out, "..      %3d\n", parent_child);
+	const std::vector<int> &children = dir_index.children(listed);
+	for (int i=0; i<(int)children.size(); i++){
+		index = children.at(i);
 		if (isDir(index)){
-			int num_child = dir_names[superblock->inode[index].name].size();
-			printf("%-5.5s   %3d\n", superblock->inode[index].name, num_child);
+			std::shared_lock<std::shared_mutex> child_dir(dir_locks[index]);
+			fprintf(session.out, "%-5.5s   %3d\n", inodes[index].name, dir_index.size(index));
 		} else {
-			if (superblock->inode[index].used_size!=0) { printf("%-5.5s   %3d KB\n", superblock->inode[index].name, (superblock->inode[index].used_size & 127));}
+			if (inodes[index].in_use) { fprintf(session.out, "%-5.5s   %3lld KB\n", inodes[index].name, (long long)inodes[index].size*geometry.block_size/1024);}
 		}
 	}
 }
 
 /**
  * @brief Function to resize a file in the current working directory to a specified size. 
- * If there are no sufficient free blocks after its allocated blocks, find contiguous free blocks of the specified size.
+ * A file grows in place when the blocks after it are free. Otherwise it is moved to contiguous free blocks of the
+ * specified size, with room for the headroom of the growth policy if possible.
  *
- * @param name - filename to be resized
+ * @param session - session running the command
+ * @param path - filename to be resized, or its path
  * @param new_size 
  */
-void fs_resize(char name[5], int new_size){
+void FileSystem::fs_resize(Session &session, const char *path, int new_size){
+	if (new_size < 0) { fprintf(session.err, "Error: File %s cannot expand to size %i\n", path, new_size); return; } // would free blocks before the file
+	std::shared_lock<std::shared_mutex> disk_shared(disk_lock);
+	const char *name;
+	int parent = resolve_parent(session, path, &name);
+	if (parent == -1) { fprintf(session.err, "Error: File %s does not exist\n", path); return; }
+	std::unique_lock<std::shared_mutex> dir(dir_locks[parent]);
 	int exists = -1;
 	int start_block = 0;		
-	if (cwd==127) { exists = check_dir_names(root, name); }
-	else { exists = check_dir_names(superblock->inode[cwd].name, name); }	
-	if (exists==-1){ fprintf(stderr, "Error: File %s does not exist\n", name);}
-	else if (isDir(exists)){ fprintf(stderr, "Error: File %s does not exist\n", name);}
+	exists = dir_index.find(parent, name);	
+	if (exists==-1){ fprintf(session.err, "Error: File %s does not exist\n", path);}
+	else if (isDir(exists)){ fprintf(session.err, "Error: File %s does not exist\n", path);}
 	else {
-		if (new_size < (superblock->inode[exists].used_size & 127)){ // if size is reduced, clear out end blocks 
-			for (int i=0; i<((superblock->inode[exists].used_size & 127) - new_size); i++){ // update free block list and clear data blocks
-				superblock->free_block_list[(int)((superblock->inode[exists].start_block+new_size+i)/8)] = 
-					setBit(superblock->free_block_list[(int)((superblock->inode[exists].start_block+new_size+i/8))], ((superblock->inode[exists].start_block+new_size+i)%8)+1, 0);
-				clear_block(superblock->inode[exists].start_block+new_size+i);
-			}
-			superblock->inode[exists].used_size = new_size;
-		} else { // find space
-			bool space = false;
-			int count = 0;
-			int block = 0; 
-			for (int i=0; i<16; i++){ // check each block in free block list
-				for(int j=0; j<8; j++){
-					if (!(superblock->free_block_list[i] >> (7-j)) & 1) { count +=1; } else { count = 0; }
-					block +=1;
-					if (count == new_size ) { space = true; start_block = block-new_size+1; break; } // space found
-				}
-			}
-			if (!space) { fprintf(stderr, "Error: File %s cannot expand to size %i\n", name, new_size); }
+		std::unique_lock<std::shared_mutex> file(file_locks[exists]);
+		std::lock_guard<std::mutex> alloc(alloc_lock);
+		int size = inodes[exists].size;
+		int end = inodes[exists].start_block + size;
+		if (new_size < size){ // if size is reduced, clear out end blocks 
+			release_headroom(exists);
+			set_blocks_state(inodes[exists].start_block+new_size, size-new_size, 0); // update free block list and clear data blocks
+			clear_blocks(inodes[exists].start_block+new_size, size-new_size);
+			inodes[exists].size = new_size;
+			add_usage(parent, new_size - size, 0, 0);
+			dirty_inodes.add(exists);
+		} else if (new_size > size && std::min(block_allocator.next_used(end), block_allocator.next_claimed(end + headroom[exists])) >= end + new_size - size) { // grow in place, over its own headroom but not another file's
+			release_headroom(exists);
+			set_blocks_state(end, new_size - size, 1);
+			inodes[exists].size = new_size;
+			add_usage(parent, new_size - size, 0, 0);
+			dirty_inodes.add(exists);
+			reserve_headroom(exists);
+		} else if (new_size > size) { // find space
+			start_block = block_allocator.find_run(new_size, wanted_headroom(new_size));
+			if (start_block == -1) { fprintf(session.err, "Error: File %s cannot expand to size %i\n", path, new_size); }
 			else {
-				for(int j=0; j<new_size; j++){ // update free block list
-					superblock->free_block_list[(int)((start_block+j)/8)] = setBit(superblock->free_block_list[(int)((start_block+j)/8)], ((start_block+j)%8)+1, 1);
-				}
+				release_headroom(exists);
+				set_blocks_state(start_block, new_size, 1); // update free block list
 
-				for(int j=0; j<((superblock->inode[exists].used_size) & 127); j++){ // transfer data to new data blocks and clear old ones, update free block list
-					memcpy(blocks[start_block+j].block, blocks[(superblock->inode[exists].start_block + j)].block, sizeof(blocks[start_block+j].block));
-					clear_block(superblock->inode[exists].start_block+j);
-					superblock->free_block_list[(int)((superblock->inode[exists].start_block+j)/8)] = setBit(superblock->free_block_list[(int)((superblock->inode[exists].start_block+j)/8)], ((superblock->inode[exists].start_block+j)%8)+1, 0);
-				}
+				// transfer data to new data blocks and clear old ones, update free block list
+				move_blocks(inodes[exists].start_block, start_block, size);
+				set_blocks_state(inodes[exists].start_block, size, 0);
 				
 				// update inode attributes
-				superblock->inode[exists].start_block = start_block;
-				superblock->inode[exists].used_size = (new_size | 128);
+				inodes[exists].start_block = start_block;
+				inodes[exists].size = new_size;
+				add_usage(parent, new_size - size, 0, 0);
+				dirty_inodes.add(exists);
+				reserve_headroom(exists);
 			}
 		}
 	}
 }
 
- /**
- * @brief Function to reorganize file blocks to reduce fragmentation (no free blocks between used blocks)
- */
-void fs_defrag(void){
-	std::map<int, int> block_map = std::map<int, int>(); // ordered map of start block and inode number to start from files with lowest start_block
-	for (int i=0; i<126; i++){ // populate the map
-		if((superblock->inode[i].used_size & 128)!=0 && (superblock->inode[i].dir_parent & 128)==0){
-			block_map[superblock->inode[i].start_block] = i;
-		}
-	}
-	std::map<int, int>::iterator it;
-	for(it = block_map.begin(); it!=block_map.end(); it++){
-		int new_start_block = 0;
-		int start_block = (superblock->inode[(it->second)].used_size & 127);
-		int block = 0;
-		int size = (superblock->inode[(it->second)].used_size & 127);
-		for (int i=0; i<16; i++){ // check each block in free block list
-			for(int j=0; j<8; j++){
-				if (!((superblock->free_block_list[i] >> (7-j)) & 1) && new_start_block == 0) { new_start_block = block;  }
-			}
+/**
+ * @brief Function to copy the contents of a file over another file in the current working directory, in one bulk copy
+ * of its blocks. The destination takes the size of the source, and is given a new extent if its size changes.
+ *
+ * @param session - session running the command
+ * @param src - name of the file to copy
+ * @param dst - name of the file to overwrite
+ */
+void FileSystem::fs_copy(Session &session, char src[5], char dst[5]){
+	std::shared_lock<std::shared_mutex> disk_shared(disk_lock);
+	std::unique_lock<std::shared_mutex> dir(dir_locks[session.cwd]);
+	int from = check_dir_names(session, src);
+	int to = check_dir_names(session, dst);
+	if (from==-1 || isDir(from)){ fprintf(session.err, "Error: File %s does not exist\n", src); return; }
+	if (to==-1 || isDir(to)){ fprintf(session.err, "Error: File %s does not exist\n", dst); return; }
+	if (from == to) { return; }
+	std::shared_lock<std::shared_mutex> src_file(file_locks[from], std::defer_lock);
+	std::unique_lock<std::shared_mutex> dst_file(file_locks[to], std::defer_lock);
+	if (from < to) { src_file.lock(); dst_file.lock(); } // files are locked in inode order
+	else { dst_file.lock(); src_file.lock(); }
+	std::lock_guard<std::mutex> alloc(alloc_lock);
+	int size = inodes[from].size;
+	int old_start = inodes[to].start_block;
+	int old_size = inodes[to].size;
+	int start = old_start;
+	if (size != old_size){ // the old extent is freed first, so the new one may reuse it
+		release_headroom(to);
+		set_blocks_state(old_start, old_size, 0);
+		start = size > 0 ? block_allocator.find_run(size) : old_start;
+		if (start == -1){
+			set_blocks_state(old_start, old_size, 1);
+			fprintf(session.err, "Error: Cannot allocate %i KB on %s\n", size, disk);
+			return;
 		}
-		for (int i=0; i<size; i++){
-			memcpy(blocks[new_start_block+i].block, blocks[(it->first)+i].block, 1024); // move data blocks
-			if ((new_start_block+size) < (start_block+size) && (new_start_block+size)>(start_block)){ //overlap
-				for (int j=0; j<(start_block-new_start_block); j++){
-					clear_block(new_start_block+size+j);
-				}
-			} else {
-				clear_block(start_block+i);
-			}
-			superblock->free_block_list[(int)((start_block+i)/8)] = setBit(superblock->free_block_list[(int)((start_block+i)/8)], ((start_block+i)%8)+1, 0);
+		clear_blocks(old_start, old_size);
+		set_blocks_state(start, size, 1);
+		inodes[to].start_block = start;
+		inodes[to].size = size;
+		add_usage(session.cwd, size - old_size, 0, 0);
+		dirty_inodes.add(to);
+	}
+	copy_blocks(inodes[from].start_block, start, size);
+}
+
+/**
+ * @brief Function to create a new file in the current working directory holding a copy of a file, in one bulk copy
+ * of its blocks into a new extent
+ *
+ * @param session - session running the command
+ * @param src - name of the file to copy
+ * @param dst - name of the new file
+ */
+void FileSystem::fs_clone(Session &session, char src[5], char dst[5]){
+	std::shared_lock<std::shared_mutex> disk_shared(disk_lock);
+	std::unique_lock<std::shared_mutex> dir(dir_locks[session.cwd]);
+	int from = check_dir_names(session, src);
+	if (from==-1 || isDir(from)){ fprintf(session.err, "Error: File %s does not exist\n", src); return; }
+	if (check_dir_names(session, dst)!=-1){ fprintf(session.err, "Error: File or directory %s already exists\n", dst); return; }
+	std::shared_lock<std::shared_mutex> src_file(file_locks[from]);
+	std::lock_guard<std::mutex> alloc(alloc_lock);
+	int index = find_free_inode(); // use the first available inode
+	if (index == -1) { fprintf(session.err, "Error: Superblock in disk %s is full, cannot create %s\n", disk, dst); return; }
+	int size = inodes[from].size;
+	int start = size > 0 ? block_allocator.find_run(size) : inodes[from].start_block;
+	if (start == -1) { fprintf(session.err, "Error: Cannot allocate %i KB on %s\n", size, disk); return; }
+	set_blocks_state(start, size, 1);
+	copy_blocks(inodes[from].start_block, start, size);
+	clear_inode(index);
+	memcpy(inodes[index].name, dst, strnlen(dst, 5));
+	inodes[index].in_use = true;
+	inodes[index].size = size;
+	inodes[index].parent = session.cwd;
+	inodes[index].start_block = start;
+	add_usage(session.cwd, size, 1, 0);
+	dirty_inodes.add(index);
+	dir_index.add(session.cwd, index, inodes[index].name);
+}
+
+/**
+ * @brief Finds a snapshot of the mounted disk by name
+ *
+ * @param name - snapshot name
+ * @return Index in snapshots, or -1 if there is none with that name
+ */
+int FileSystem::find_snapshot(const char *name){
+	for (int i=0; i<(int)snapshots.size(); i++){
+		if (snapshots[i].name == name) { return i; }
+	}
+	return -1;
+}
+
+/**
+ * @brief Function to take a snapshot of the mounted disk, replacing any snapshot with the same name. The superblock is
+ * copied and the pages of the data blocks are pinned, so the blocks written from then on are copied instead.
+ *
+ * @param session - session running the command
+ * @param name - snapshot name
+ */
+void FileSystem::fs_snapshot(Session &session, const char *name){
+	std::unique_lock<std::shared_mutex> lock(disk_lock);
+	if (!block_store.is_paged()) { fprintf(session.err, "Error: Cannot take snapshots of memory-mapped disk %s\n", disk); return; }
+	int existing = find_snapshot(name);
+	if (existing != -1){
+		block_store.unpin(snapshots[existing].pages);
+		snapshots.erase(snapshots.begin() + existing);
+	}
+	Snapshot snapshot;
+	snapshot.name = name;
+	snapshot.free_block_list.assign(meta + bitmap_offset(geometry), meta + inode_offset(geometry));
+	snapshot.inodes = inodes;
+	if (geometry.checksums) { snapshot.checksums.assign(meta + checksum_offset(geometry), meta + meta_bytes(geometry)); }
+	snapshot.pages = block_store.pin();
+	snapshots.push_back(snapshot);
+}
+
+/**
+ * @brief Function to list the snapshots of the mounted disk, oldest first, with the inodes and data blocks they use
+ *
+ * @param session - session running the command
+ */
+void FileSystem::fs_list_snapshots(Session &session){
+	std::shared_lock<std::shared_mutex> disk_shared(disk_lock);
+	for (int i=0; i<(int)snapshots.size(); i++){
+		const Snapshot &snapshot = snapshots[i];
+		int used_inodes = 0;
+		long long used_blocks = 0;
+		for (int j=0; j<geometry.num_inodes; j++){
+			if (snapshot.inodes[j].in_use) { used_inodes++; }
 		}
-		// set free block list
-		for (int i=0; i<size; i++){ superblock->free_block_list[(int)((new_start_block+i)/8)] = setBit(superblock->free_block_list[(int)((new_start_block+i)/8)], ((start_block+i)%8)+1, 1); } 
+		for (int b=first_data; b<geometry.num_blocks; b++){
+			if ((snapshot.free_block_list[b/8] >> (7 - b%8)) & 1) { used_blocks++; }
+		}
+		fprintf(session.out, "%-20s %3d inodes %4lld KB\n", snapshot.name.c_str(), used_inodes, used_blocks*geometry.block_size/1024);
 	}
 }
 
+/**
+ * @brief Checks if two inodes hold the same fields
+ */
+static bool same_inode(const Inode &a, const Inode &b){
+	return memcmp(a.name, b.name, 5)==0 && a.in_use==b.in_use && a.is_dir==b.is_dir && a.size==b.size && a.start_block==b.start_block && a.parent==b.parent;
+}
+
+/**
+ * @brief Function to roll the mounted disk back to a snapshot, which is kept. Only the inodes and blocks that differ
+ * from the snapshot are written back, and every session returns to the root directory.
+ *
+ * @param session - session running the command
+ * @param name - snapshot name
+ */
+void FileSystem::fs_rollback(Session &session, const char *name){
+	std::unique_lock<std::shared_mutex> lock(disk_lock);
+	int index = find_snapshot(name);
+	if (index == -1) { fprintf(session.err, "Error: Snapshot %s does not exist\n", name); return; }
+	const Snapshot &snapshot = snapshots[index];
+	uint8_t *free_block_list = meta + bitmap_offset(geometry);
+	for (int w=0; w<dirty_free_list.size(); w++){
+		if (memcmp(free_block_list + w*8, snapshot.free_block_list.data() + w*8, 8)!=0) { dirty_free_list.add(w); }
+	}
+	for (int i=0; i<geometry.num_inodes; i++){
+		if (!same_inode(inodes[i], snapshot.inodes[i])) { dirty_inodes.add(i); }
+	}
+	for (int b=first_data; b<geometry.num_blocks; b++){
+		if (snapshot.pages[b] != NOT_LOADED && block_store.page_of(b) != snapshot.pages[b]) { dirty_blocks.add(b); } // blocks left on disk go back to it
+	}
+	memcpy(free_block_list, snapshot.free_block_list.data(), snapshot.free_block_list.size());
+	if (geometry.checksums) { memcpy(meta + checksum_offset(geometry), snapshot.checksums.data(), snapshot.checksums.size()); }
+	inodes = snapshot.inodes;
+	first_free_inode = 0;
+	block_store.restore(snapshot.pages);
+	Alloc_policy policy = block_allocator.get_policy();
+	block_allocator.attach((char *)free_block_list, geometry.num_blocks);
+	block_allocator.set_policy(policy);
+	block_checksums.attach(geometry.checksums ? meta + checksum_offset(geometry) : NULL, geometry.num_blocks, geometry.block_size); // blocks are verified again
+	std::fill(headroom.begin(), headroom.end(), 0);
+	defrag_budget = 0;
+	build_dir_index(geometry, inodes, dir_index);
+	build_usage();
+	generation = next_generation++; // directories may come back as other inodes
+	for (int i=0; i<(int)sessions.size(); i++) { sessions[i]->cwd = root; }
+	session.cwd = root;
+}
+
+/**
+ * @brief Function to write a snapshot of the mounted disk to a new disk image
+ *
+ * @param session - session running the command
+ * @param name - snapshot name
+ * @param file - name of the image to write
+ */
+void FileSystem::fs_export(Session &session, const char *name, const char *file){
+	std::shared_lock<std::shared_mutex> disk_shared(disk_lock);
+	int index = find_snapshot(name);
+	if (index == -1) { fprintf(session.err, "Error: Snapshot %s does not exist\n", name); return; }
+	const Snapshot &snapshot = snapshots[index];
+	if (same_file(disk_fd, file)){
+		fprintf(session.err, "Error: Cannot write snapshot %s over mounted disk %s\n", name, disk); // blocks of the snapshot are read from it
+		return;
+	}
+	std::vector<uint8_t> image((size_t)first_data*geometry.block_size, 0); // superblock of the snapshot, with the header of the disk
+	memcpy(image.data(), meta, bitmap_offset(geometry));
+	memcpy(image.data() + bitmap_offset(geometry), snapshot.free_block_list.data(), snapshot.free_block_list.size());
+	for (int i=0; i<geometry.num_inodes; i++) { encode_inode(geometry, snapshot.inodes[i], image.data(), i); }
+	if (geometry.checksums) { memcpy(image.data() + checksum_offset(geometry), snapshot.checksums.data(), snapshot.checksums.size()); }
+	FILE *out = fopen(file, "wb");
+	bool ok = out != NULL && fwrite(image.data(), image.size(), 1, out) == 1;
+	std::vector<uint8_t> buffer(geometry.block_size);
+	for (int b=first_data; ok && b<geometry.num_blocks; b++){
+		const uint8_t *data = snapshot.pages[b] != NOT_LOADED ? block_store.read_page(snapshot.pages[b]) : block_store.read_disk(b, buffer.data());
+		ok = data != NULL && fwrite(data, geometry.block_size, 1, out) == 1;
+	}
+	if (out != NULL && fclose(out) != 0) { ok = false; }
+	if (!ok) { fprintf(session.err, "Error: Cannot write snapshot %s to %s\n", name, file); }
+}
+
+/**
+ * @brief Drops every snapshot of the mounted disk
+ */
+void FileSystem::drop_snapshots(void){
+	for (int i=0; i<(int)snapshots.size(); i++) { block_store.unpin(snapshots[i].pages); }
+	snapshots.clear();
+}
+
+/**
+ * @brief Builds the compaction plan: files in order of start block, packed from the first data block. Files that are already in
+ * position are left out. Executing any prefix of the plan in order leaves the disk consistent, since every move
+ * only slides a file down into blocks freed by the moves before it.
+ *
+ * @return Moves in the order they must be executed
+ */
+std::vector<FileSystem::Defrag_move> FileSystem::defrag_plan(void){
+	std::vector<Defrag_move> files;
+	for (int i=0; i<geometry.num_inodes; i++){
+		if(inodes[i].in_use && !inodes[i].is_dir && inodes[i].size!=0){
+			Defrag_move move = { i, inodes[i].start_block, 0, inodes[i].size };
+			files.push_back(move);
+		}
+	}
+	std::sort(files.begin(), files.end(), [](const Defrag_move &a, const Defrag_move &b){ return a.from < b.from; });
+	std::vector<Defrag_move> plan;
+	int next = first_data;
+	for (int i=0; i<(int)files.size(); i++){
+		files[i].to = next;
+		next += files[i].size;
+		if (files[i].to != files[i].from) { plan.push_back(files[i]); }
+	}
+	return plan;
+}
+
+/**
+ * @brief Moves a file to its planned start block
+ *
+ * @param move - planned move
+ */
+void FileSystem::defrag_move(const Defrag_move &move){
+	move_blocks(move.from, move.to, move.size);
+	inodes[move.index].start_block = move.to;
+	dirty_inodes.add(move.index);
+}
+
  /**
- * @brief Function to change the current working directory to the given directory name
+ * @brief Function to reorganize file blocks to reduce fragmentation (no free blocks between used blocks).
+ * Only files that are out of position are moved, and the free block list is rewritten in two runs at the end.
+ */
+void FileSystem::fs_defrag(void){
+	std::unique_lock<std::shared_mutex> lock(disk_lock);
+	block_allocator.clear_reservations(); // compaction removes the gaps headroom was kept in
+	std::fill(headroom.begin(), headroom.end(), 0);
+	defrag_budget = 0; // a full compaction finishes any background compaction
+	std::vector<Defrag_move> plan = defrag_plan();
+	if (plan.empty()) { return; }
+	for (int i=0; i<(int)plan.size(); i++){ defrag_move(plan[i]); }
+	int data = geometry.num_blocks - first_data;
+	int used = data - block_allocator.free_count();
+	set_blocks_state(first_data, used, 1);
+	set_blocks_state(first_data+used, data-used, 0);
+}
+
+/**
+ * @brief One step of background compaction: moves files in plan order while the carried budget covers them.
+ * The caller holds the disk exclusively.
+ */
+void FileSystem::defrag_step(void){
+	defrag_credit += defrag_budget;
+	std::vector<Defrag_move> plan = defrag_plan();
+	int i = 0;
+	for (; i<(int)plan.size() && plan[i].size <= defrag_credit; i++){
+		set_blocks_state(plan[i].from, plan[i].size, 0);
+		set_blocks_state(plan[i].to, plan[i].size, 1);
+		defrag_move(plan[i]);
+		defrag_credit -= plan[i].size;
+	}
+	if (i == (int)plan.size()) { defrag_budget = 0; defrag_credit = 0; } // disk is compacted
+	else { defrag_credit = std::min(defrag_credit, plan[i].size); } // never save more than the next move needs
+}
+
+/**
+ * @brief Starts or stops background compaction, which moves at most the given number of blocks per command
  *
- * @param name - directory name
+ * @param budget - blocks to move per command, 0 to stop
  */
-void fs_cd(char name[5]){
-	if (strcmp(name, ".")==0){ // stay in current working directory
-		return; 
-	} else if (strcmp(name, "..")==0){ //go to parent
-		if (cwd==127){ return; } // root has no parent
-		else{
-			cwd = (superblock->inode[cwd].dir_parent & 127);
+void FileSystem::fs_defrag_background(int budget){
+	std::unique_lock<std::shared_mutex> lock(disk_lock);
+	defrag_budget = budget;
+	defrag_credit = 0;
+	if (budget == 0) { return; }
+	block_allocator.clear_reservations();
+	std::fill(headroom.begin(), headroom.end(), 0);
+	defrag_step();
+}
+
+/**
+ * @brief Function to print the allocation policy and free space metrics of the mounted disk: free blocks, largest free run,
+ *  failed allocations and a histogram of free extents by size
+ *
+ * @param session - session running the command
+ */
+void FileSystem::fs_free(Session &session){
+	std::shared_lock<std::shared_mutex> disk_shared(disk_lock);
+	std::lock_guard<std::mutex> alloc(alloc_lock);
+	int num_buckets = 32 - __builtin_clz(geometry.num_blocks); // the last bucket holds the runs of half the disk or more
+	std::vector<int> histogram(num_buckets);
+	int largest = block_allocator.extent_histogram(histogram.data(), num_buckets);
+	int free_blocks = block_allocator.free_count();
+	fprintf(session.out, "Policy: %s\n", Block_allocator::policy_name(block_allocator.get_policy()));
+	fprintf(session.out, "Free blocks: %d, largest free run: %d, failed allocations: %d\n", free_blocks, largest, block_allocator.failed_allocations());
+	fprintf(session.out, "Fragmentation: %d%%\n", free_blocks == 0 ? 0 : 100 - (100*largest)/free_blocks);
+	if (block_allocator.reserved_count() > 0) { fprintf(session.out, "Reserved headroom: %d\n", block_allocator.reserved_count()); }
+	if (options.dedup){ // distinct pages holding the blocks in use
+		std::vector<int> pages;
+		for (int b=first_data; b<geometry.num_blocks; b++){
+			if (block_allocator.is_used(b)) { pages.push_back(block_store.load(b)); }
 		}
-	} else {
-		char * dir;
-		if(cwd==127){ dir = root; } else { dir = superblock->inode[cwd].name; }
-		int index = check_dir_names(dir, name); // find directory in the current working directory
-		if(index!=-1 && isDir(index)){ cwd = index; }
-		else { fprintf(stderr, "Error: Directory %s does not exist\n", name); }
+		std::sort(pages.begin(), pages.end());
+		int used = pages.size();
+		int stored = std::unique(pages.begin(), pages.end()) - pages.begin();
+		fprintf(session.out, "Deduplicated blocks: %d used blocks stored in %d\n", used, stored);
+	}
+	for (int i=0; i<num_buckets; i++){
+		if (histogram[i]==0) { continue; }
+		if (i==0) { fprintf(session.out, "Free extents of 1 block: %d\n", histogram[i]); }
+		else if (i==num_buckets-1) { fprintf(session.out, "Free extents of %d or more blocks: %d\n", 1<<i, histogram[i]); }
+		else { fprintf(session.out, "Free extents of %d-%d blocks: %d\n", 1<<i, (2<<i)-1, histogram[i]); }
+	}
+}
+
+/**
+ * @brief Function to report the space used below a directory, as kept up to date by every change instead of walking
+ * the tree
+ *
+ * @param session - session running the command
+ * @param name - name of a directory in the current working directory, or NULL for the current working directory
+ */
+void FileSystem::fs_usage(Session &session, const char *name){
+	std::shared_lock<std::shared_mutex> disk_shared(disk_lock);
+	std::shared_lock<std::shared_mutex> dir(dir_locks[session.cwd]);
+	int index = session.cwd;
+	if (name != NULL){
+		index = check_dir_names(session, name);
+		if (index == -1 || !isDir(index)) { fprintf(session.err, "Error: Directory %s does not exist\n", name); return; }
+	}
+	const Dir_usage &u = usage[index];
+	fprintf(session.out, "%-5.5s %lld KB in %d files and %d directories\n", name != NULL ? name : ".", (long long)u.blocks*geometry.block_size/1024, u.files.load(), u.dirs.load());
+}
+
+/**
+ * @brief Function to verify every data block in use against its checksum, split across threads for large disks.
+ * Blocks are checked as they are on disk, read without being loaded so the block cache is left as it was, except
+ * blocks changed since the last write-back, which are checked in memory. Each damaged block is reported with the file
+ * holding it.
+ *
+ * @param session - session running the command
+ */
+void FileSystem::fs_scrub(Session &session){
+	std::unique_lock<std::shared_mutex> lock(disk_lock); // no block changes while it is verified
+	if (!block_checksums.enabled()) { fprintf(session.err, "Error: Disk %s has no checksums\n", disk); return; }
+	int num_threads = 1;
+	if (geometry.num_blocks >= PARALLEL_SCRUB_BLOCKS){
+		num_threads = std::max(1, std::min((int)std::thread::hardware_concurrency(), geometry.num_blocks / (PARALLEL_SCRUB_BLOCKS/4)));
+	}
+	std::vector<std::vector<int>> damaged(num_threads); // blocks that did not match, in order within each thread
+	std::vector<int> scrubbed(num_threads, 0);
+	auto scrub = [&](int t){
+		uint8_t buffer[MAX_BLOCK_SIZE];
+		int first = first_data + (int)((int64_t)(geometry.num_blocks - first_data)*t/num_threads);
+		int last = first_data + (int)((int64_t)(geometry.num_blocks - first_data)*(t+1)/num_threads);
+		for (int b=first; b<last; b++){
+			if (!block_allocator.is_used(b)) { continue; }
+			bool on_disk = block_store.is_paged() && !dirty_blocks.contains(b); // a block unchanged since the write-back is checked on disk, not in memory
+			const uint8_t *data = on_disk ? block_store.read_disk(b, buffer) : block_store.peek(b, buffer);
+			if (data == NULL || !block_checksums.check(b, data)) { damaged[t].push_back(b); }
+			scrubbed[t]++;
+		}
+	};
+	if (num_threads == 1) { scrub(0); }
+	else {
+		std::vector<std::thread> threads;
+		for (int t=0; t<num_threads; t++) { threads.push_back(std::thread(scrub, t)); }
+		for (int t=0; t<num_threads; t++) { threads[t].join(); }
+	}
+	std::vector<int> owner(geometry.num_blocks, -1); // file holding every block in use
+	for (int i=0; i<geometry.num_inodes; i++){
+		if (!inodes[i].in_use || inodes[i].is_dir) { continue; }
+		for (int b=0; b<inodes[i].size; b++) { owner[inodes[i].start_block + b] = i; }
+	}
+	int total = 0, errors = 0;
+	for (int t=0; t<num_threads; t++){
+		total += scrubbed[t];
+		errors += damaged[t].size();
+		for (int i=0; i<(int)damaged[t].size(); i++){
+			int b = damaged[t][i];
+			if (owner[b] == -1) { fprintf(session.err, "Error: Checksum mismatch in block %i\n", b); }
+			else { fprintf(session.err, "Error: Checksum mismatch in block %i of %.5s\n", b - inodes[owner[b]].start_block, inodes[owner[b]].name); }
+		}
+	}
+	fprintf(session.out, "Scrubbed %d blocks, %d checksum errors\n", total, errors);
+}
+
+ /**
+ * @brief Function to change the current working directory to the given directory name, or the directory a path
+ * leads to
+ *
+ * @param session - session running the command
+ * @param path - directory name, or its path
+ */
+void FileSystem::fs_cd(Session &session, const char *path){
+	std::shared_lock<std::shared_mutex> disk_shared(disk_lock);
+	int index = resolve_dir(session, path, strlen(path)); // "." stays, ".." goes to the parent, root has no parent
+	if (index != -1) { session.cwd = index; }
+	else { fprintf(session.err, "Error: Directory %s does not exist\n", path); }
+}
+
+#define MAX_ARGS 5 // most tokens taken by a command, counting the command itself
+#define BINARY_MAGIC "FSB1" // first bytes of an input file of binary commands
+#define MAX_RECORD 65535 // largest binary command
+
+/**
+ * @brief Splits a line into tokens separated by spaces, in place: the space after each token is overwritten to end it
+ *
+ * @param line - line to split
+ * @param args - receives the first MAX_ARGS tokens
+ * @param last - receives the last token, or NULL if there are none
+ * @return Number of tokens in the line
+ */
+static int tokenize(char *line, char *args[MAX_ARGS], char **last){
+	int count = 0;
+	*last = NULL;
+	for (char *p = line; ; ){
+		while (*p == ' ') { p++; }
+		if (*p == '\0') { break; }
+		if (count < MAX_ARGS) { args[count] = p; }
+		*last = p;
+		count++;
+		while (*p != ' ' && *p != '\0') { p++; }
+		if (*p == '\0') { break; }
+		*p++ = '\0';
 	}
+	return count;
 }
 
 /**
- * @brief This function handles the commands read line by line from the input file
+ * @brief Parses a number argument the way stoi does: an optional sign and decimal digits, ignoring what follows them
  *
- * @param line - the line from the file
+ * @param arg - argument to parse
+ * @param value - receives the number
+ * @return false if the argument does not start with a number or the number does not fit in an int
+ */
+static bool parse_int(const char *arg, int *value){
+	bool negative = (*arg == '-');
+	if (*arg == '-' || *arg == '+') { arg++; }
+	if (*arg < '0' || *arg > '9') { return false; }
+	long long n = 0;
+	for (; *arg >= '0' && *arg <= '9'; arg++){
+		n = n*10 + (*arg - '0');
+		if (n > 2147483648LL) { return false; }
+	}
+	if (negative) { n = -n; }
+	if (n > 2147483647LL) { return false; }
+	*value = (int)n;
+	return true;
+}
+
+/**
+ * @brief Checks a path argument: a name of at most 5 characters, or names separated by '/' ending in one, or "/"
+ *
+ * @param arg - argument to check
+ */
+static bool valid_path(const char *arg){
+	size_t len = strlen(arg);
+	if (len > MAX_PATH_LENGTH) { return false; }
+	if (len == 1 && arg[0] == '/') { return true; }
+	const char *slash = strrchr(arg, '/');
+	size_t leaf = slash == NULL ? len : len - (slash - arg) - 1;
+	return leaf >= 1 && leaf <= 5;
+}
+
+/**
+ * @brief This function handles the commands read line by line from the input file. The line is split in place and
+ * every number is parsed once, so running a command allocates nothing. Every command is counted, and sampled
+ * commands are timed, for the statistics report.
+ *
+ * @param session - session running the command
+ * @param line - the line from the file, overwritten while it is split
  * @param line_no - line number (mostly for error handling)
+ * @param payload - raw bytes given with a binary B or W command, or NULL
+ * @param payload_len - number of bytes in the payload
  */
-void process_command(string line, int line_no){
-	char cline[line.size()+1];
-	strcpy(cline, line.c_str());
- 	char* chars_array = strtok(cline, " ");
-	std::vector<char*> command_args;
-   	while(chars_array)
-   	{
-	        command_args.push_back(chars_array);
-       		chars_array = strtok(NULL, " ");
-    	}
-	if (cline[0]=='M' && command_args.size()==2 && strlen(command_args.at(1))<=20){ // mount disk
-		fs_mount(command_args.at(1));
-		if (strlen(disk)!=0) { write_to_disk(disk); }
-	} else if (cline[0]=='C' && command_args.size()==3 && strlen(command_args.at(1))<=5 && stoi(command_args.at(2))<128){ // create file/directory
-		if(strlen(disk)==0){ fprintf(stderr, "Error: No file system is mounted\n"); }
+void FileSystem::process_command(Session &session, char *line, int line_no, const uint8_t *payload, size_t payload_len){
+	char command = line[0];
+	uint64_t started = stats_start(command);
+	char *args[MAX_ARGS];
+	char *last;
+	int count = tokenize(line, args, &last);
+	int n = 0; // every command taking a number has it last
+	int first = 0; // first block of a range
+	bool numeric = count > 1 && parse_int(last, &n);
+	if (defrag_budget > 0 && mounted){ // background compaction runs between commands
+		std::unique_lock<std::shared_mutex> lock(disk_lock);
+		if (defrag_budget > 0 && mounted) { defrag_step(); }
+	}
+	Alloc_policy policy;
+	if (command=='M' && count==2 && strlen(args[1])<=20){ // mount disk
+		fs_mount(session, args[1], options.alloc_policy);
+		if (mounted) { persist(session); }
+	} else if (command=='M' && count==3 && strlen(args[1])<=20 && Block_allocator::parse_policy(args[2], &policy)){ // mount disk with an allocation policy
+		fs_mount(session, args[1], policy);
+		if (mounted) { persist(session); }
+	} else if (command=='C' && count==3 && valid_path(args[1]) && numeric && n<disk_blocks){ // create file/directory
+		if(!mounted){ fprintf(session.err, "Error: No file system is mounted\n"); }
 		else{
-			fs_create(command_args.at(1), stoi(command_args.at(2)));
-			write_to_disk(disk);
+			fs_create(session, args[1], n);
+			persist(session);
 		}
-	} else if (cline[0]=='D' && command_args.size()==2 && strlen(command_args.at(1))<=5){ // delete file/directory
-		if(strlen(disk)==0){ fprintf(stderr, "Error: No file system is mounted\n"); }
+	} else if (command=='D' && count==2 && valid_path(args[1])){ // delete file/directory
+		if(!mounted){ fprintf(session.err, "Error: No file system is mounted\n"); }
 		else{
-			fs_delete(command_args.at(1));
-			write_to_disk(disk);
+			fs_delete(session, args[1]);
+			persist(session);
 		}
-	} else if (cline[0]=='R' && command_args.size()==3 && strlen(command_args.at(1))<=5 && stoi(command_args.at(2))<128 && stoi(command_args.at(2))>=0){ // read from file
-		if(strlen(disk)==0){ fprintf(stderr, "Error: No file system is mounted\n"); }
+	} else if (command=='R' && count==3 && valid_path(args[1]) && numeric && n<disk_blocks && n>=0){ // read from file
+		if(!mounted){ fprintf(session.err, "Error: No file system is mounted\n"); }
 		else{
-			fs_read(command_args.at(1), stoi(command_args.at(2)));
-			write_to_disk(disk);
+			fs_read(session, args[1], n);
+			persist(session);
 		}
-	} else if (cline[0]=='W' && command_args.size()==3 && strlen(command_args.at(1))<=5 && stoi(command_args.at(2))<128 && stoi(command_args.at(2))>=0){ // write to file
-		if(strlen(disk)==0){ fprintf(stderr, "Error: No file system is mounted\n"); }
+	} else if ((command=='R' || command=='W') && (count==4 || count==5) && valid_path(args[1]) && parse_int(args[2], &first) && parse_int(args[3], &n) && first>=0 && first<n && n<disk_blocks){ // read or write a range of blocks
+		if(!mounted){ fprintf(session.err, "Error: No file system is mounted\n"); }
 		else{
-			fs_write(command_args.at(1), stoi(command_args.at(2)));
-			write_to_disk(disk);
+			const char *host = (count==5) ? args[4] : NULL;
+			if (command=='R') { fs_read_range(session, args[1], first, n, host); }
+			else { fs_write_range(session, args[1], first, n, host); }
+			persist(session);
 		}
-	} else if (cline[0]=='B' && command_args.size()>1){ // update data buffer
-		if(strlen(disk)==0){ fprintf(stderr, "Error: No file system is mounted\n"); }
+	} else if (command=='W' && count==3 && valid_path(args[1]) && numeric && n<disk_blocks && n>=0){ // write to file, after loading the buffer with the payload of a binary command
+		if(!mounted){ fprintf(session.err, "Error: No file system is mounted\n"); }
 		else{
-			uint8_t b[1024];
-			for (int i = 1; i<(int)command_args.size(); i++){
-				memcpy(b, command_args.at(i), sizeof(b));
-			}
-			fs_buff(b);
+			if (payload != NULL) { fs_buff(session, payload, payload_len); }
+			fs_write(session, args[1], n);
+			persist(session);
 		}
-	} else if (cline[0]=='L' && command_args.size()==1){ // list files and directories in current working directory
-		if(strlen(disk)==0){ fprintf(stderr, "Error: No file system is mounted\n"); }
-		else{ fs_ls(); }
-	} else if (cline[0]=='E' && command_args.size()==3 && strlen(command_args.at(1))<=5){ // resize file
-		if(strlen(disk)==0){ fprintf(stderr, "Error: No file system is mounted\n"); }
+	} else if (command=='B' && (count>1 || payload != NULL)){ // update data buffer with the last token, or the payload of a binary command
+		if(!mounted){ fprintf(session.err, "Error: No file system is mounted\n"); }
 		else{
-			fs_resize(command_args.at(1), stoi(command_args.at(2)));
-			write_to_disk(disk);
+			if (payload != NULL) { fs_buff(session, payload, payload_len); }
+			else { fs_buff(session, (const uint8_t *)last, strlen(last)); }
 		}
-	} else if (cline[0]=='O' && command_args.size()==1){ // defragment disk
-		if(strlen(disk)==0){ fprintf(stderr, "Error: No file system is mounted\n"); }
+	} else if (command=='L' && (count==1 || (count==2 && valid_path(args[1])))){ // list files and directories in current working directory, or a directory
+		if(!mounted){ fprintf(session.err, "Error: No file system is mounted\n"); }
+		else{ fs_ls(session, count==2 ? args[1] : NULL); }
+	} else if (command=='E' && count==3 && valid_path(args[1]) && numeric && n<disk_blocks && n>=0){ // resize file
+		if(!mounted){ fprintf(session.err, "Error: No file system is mounted\n"); }
+		else{
+			fs_resize(session, args[1], n);
+			persist(session);
+		}
+	} else if (command=='O' && count==1){ // defragment disk
+		if(!mounted){ fprintf(session.err, "Error: No file system is mounted\n"); }
 		else{
 			fs_defrag();
-			write_to_disk(disk);
+			persist(session);
+		}
+	} else if (command=='O' && count==2 && numeric && n>=0){ // defragment disk in the background
+		if(!mounted){ fprintf(session.err, "Error: No file system is mounted\n"); }
+		else{
+			fs_defrag_background(n);
+			persist(session);
 		}
-	} else if (cline[0]=='Y' && command_args.size()==2 && strlen(command_args.at(1))<=5){ // change working directory
-		if(strlen(disk)==0){ fprintf(stderr, "Error: No file system is mounted\n"); }
-		else{ fs_cd(command_args.at(1)); }
+	} else if (command=='F' && count==1){ // free space report
+		if(!mounted){ fprintf(session.err, "Error: No file system is mounted\n"); }
+		else{ fs_free(session); }
+	} else if ((command=='P' || command=='N') && count==3 && strlen(args[1])<=5 && strlen(args[2])<=5){ // copy a file over another, or clone it to a new name
+		if(!mounted){ fprintf(session.err, "Error: No file system is mounted\n"); }
+		else{
+			if (command=='P') { fs_copy(session, args[1], args[2]); }
+			else { fs_clone(session, args[1], args[2]); }
+			persist(session);
+		}
+	} else if (command=='Z' && count<=2 && (count==1 || strlen(args[1])<=20)){ // take a snapshot, or list them
+		if(!mounted){ fprintf(session.err, "Error: No file system is mounted\n"); }
+		else if (count==1){ fs_list_snapshots(session); }
+		else{ fs_snapshot(session, args[1]); }
+	} else if (command=='U' && count==2){ // roll back to a snapshot
+		if(!mounted){ fprintf(session.err, "Error: No file system is mounted\n"); }
+		else{
+			fs_rollback(session, args[1]);
+			persist(session);
+		}
+	} else if (command=='X' && count==3){ // export a snapshot as a disk image
+		if(!mounted){ fprintf(session.err, "Error: No file system is mounted\n"); }
+		else{ fs_export(session, args[1], args[2]); }
+	} else if (command=='Y' && count==2 && valid_path(args[1])){ // change working directory
+		if(!mounted){ fprintf(session.err, "Error: No file system is mounted\n"); }
+		else{ fs_cd(session, args[1]); }
+	} else if (command=='Q' && (count==1 || (count==2 && strlen(args[1])<=5))){ // space used below a directory
+		if(!mounted){ fprintf(session.err, "Error: No file system is mounted\n"); }
+		else{ fs_usage(session, count==2 ? args[1] : NULL); }
+	} else if (command=='V' && count==1){ // verify every block in use against its checksum
+		if(!mounted){ fprintf(session.err, "Error: No file system is mounted\n"); }
+		else{ fs_scrub(session); }
+	} else if (command=='S' && (count==1 || (count==2 && strcmp(args[1], "json")==0))){ // report statistics
+		stats_report(session.out, count==2);
 	} else {
-		fprintf(stderr, "Command Error: %s, %i\n", input_file, line_no);
+		fprintf(session.err, "Command Error: %s, %i\n", session.input_file, line_no);
+		command = '?';
 	}
+	stats_command(command, started);
 }
 
-int main(int argc, char *argv[]){
-	init();
-	if (argc!=2){
-		fprintf(stderr, "Error: Incorrect number of arguments");
+/**
+ * @brief Parses the -f flush policy option: "always", "exit" or a number of commands between write-backs
+ *
+ * @param arg - option argument
+ * @param options - options to set
+ * @return false if the argument is not a valid policy
+ */
+bool parse_flush_policy(const char *arg, Fs_options &options){
+	if (strcmp(arg, "always")==0) { options.flush_policy = FLUSH_ALWAYS; }
+	else if (strcmp(arg, "exit")==0) { options.flush_policy = FLUSH_ON_EXIT; }
+	else {
+		char *end;
+		long n = strtol(arg, &end, 10);
+		if (*end!='\0' || n < 1) { return false; }
+		options.flush_policy = (n == 1) ? FLUSH_ALWAYS : FLUSH_EVERY_N;
+		options.flush_interval = (int)n;
 	}
-	else{
-		input_file = argv[1];
-		string line;
-		ifstream inFile;
-		inFile.open(input_file);
-		if (inFile.is_open()) {
-			while (!inFile.eof()) {
-				getline(inFile, line);
-				line_no +=1;
-				process_command(line, line_no);
+	return true;
+}
 
+/**
+ * @brief Parses the -g growth policy option: "none", "double" or a number of extra blocks to keep after a growing file
+ *
+ * @param arg - option argument
+ * @param options - options to set
+ * @return false if the argument is not a valid policy
+ */
+bool parse_growth_policy(const char *arg, Fs_options &options){
+	if (strcmp(arg, "none")==0) { options.growth_factor = 1; options.growth_blocks = 0; }
+	else if (strcmp(arg, "double")==0) { options.growth_factor = 2; options.growth_blocks = 0; }
+	else {
+		char *end;
+		long n = strtol(arg, &end, 10);
+		if (*end!='\0' || n < 0 || n > MAX_DISK_BLOCKS) { return false; }
+		options.growth_factor = 1;
+		options.growth_blocks = (int)n;
+	}
+	return true;
+}
+
+/**
+ * @brief Parses the -k option: the most data blocks kept in memory, 0 for no limit
+ *
+ * @param arg - option argument
+ * @param options - options to set
+ * @return false if the argument is not a number of blocks
+ */
+bool parse_cache_size(const char *arg, Fs_options &options){
+	char *end;
+	long n = strtol(arg, &end, 10);
+	if (*end!='\0' || n < 0 || n > MAX_DISK_BLOCKS) { return false; }
+	options.cache_blocks = (int)n;
+	return true;
+}
+
+/**
+ * @brief Writes the statistics report at exit: human-readable to stderr and as JSON to a file
+ *
+ * @param json_file - name of the JSON report
+ */
+void write_stats(const char *json_file){
+	stats_report(stderr, false);
+	FILE *out = fopen(json_file, "w");
+	if (out == NULL) { fprintf(stderr, "Error: Cannot write statistics to %s\n", json_file); return; }
+	stats_report(out, true);
+	fclose(out);
+}
+
+/**
+ * @brief Runs the binary commands of an input file, following its BINARY_MAGIC. Each command is a 2 byte little endian
+ * length followed by that many bytes: the text of the command, then for B and W optionally a zero byte and a raw
+ * payload of up to a block loaded into the buffer.
+ *
+ * @param session - session running the commands
+ * @param in - input file, positioned after the magic
+ */
+void FileSystem::run_binary(Session &session, ifstream &in){
+	char record[MAX_RECORD+1];
+	uint8_t length[2];
+	int record_no = 0;
+	while (in.read((char *)length, sizeof(length))){
+		size_t len = length[0] | (length[1] << 8);
+		record_no++;
+		if (!in.read(record, len)) { // cut short
+			fprintf(session.err, "Command Error: %s, %i\n", session.input_file, record_no);
+			break;
+		}
+		record[len] = '\0';
+		size_t text_len = strlen(record);
+		const uint8_t *payload = text_len < len ? (const uint8_t *)record + text_len + 1 : NULL;
+		process_command(session, record, record_no, payload, payload ? len - text_len - 1 : 0);
+	}
+}
+
+void FileSystem::run(Session &session, const char *input_file){
+	session.input_file = input_file;
+	attach(session);
+	string line; // reused for every line, so it stops allocating once it holds the longest line
+	ifstream inFile;
+	int line_no = 0;
+	inFile.open(input_file, ios::binary);
+	if (inFile.is_open()) {
+		char magic[sizeof(BINARY_MAGIC)-1];
+		if (inFile.read(magic, sizeof(magic)) && memcmp(magic, BINARY_MAGIC, sizeof(magic))==0){
+			run_binary(session, inFile);
+		} else { // the bytes read for the magic start the first lines, since a pipe cannot seek back to them
+			string head(magic, inFile.gcount());
+			inFile.clear();
+			size_t start = 0;
+			for (size_t newline; (newline = head.find('\n', start)) != string::npos; start = newline+1){
+				line.assign(head, start, newline - start);
+				line_no +=1;
+				process_command(session, &line[0], line_no);
 			}
-			inFile.close();
+			head.erase(0, start);
+			do {
+				getline(inFile, line);
+				if (!head.empty()) { line.insert(0, head); head.clear(); }
+				line_no +=1;
+				process_command(session, &line[0], line_no);
+			} while (inFile.good()); // stops at the end of the input, or if it cannot be read
 		}
+		inFile.close();
 	}
+	detach(session);
+}
+
+void FileSystem::attach(Session &session){
+	std::unique_lock<std::shared_mutex> lock(disk_lock);
+	sessions.push_back(&session);
 }
 
+void FileSystem::detach(Session &session){
+	std::unique_lock<std::shared_mutex> lock(disk_lock);
+	std::vector<Session *>::iterator it = std::find(sessions.begin(), sessions.end(), &session);
+	if (it != sessions.end()) { sessions.erase(it); }
+}
 
+/**
+ * @brief Runs several input files in parallel. Each file runs in its own session, on its own file system, or with
+ * shared set, all on one file system so they share its mounted disk. The output of each file is buffered and printed
+ * in the order the files were given.
+ *
+ * @param input_files - names of the input files
+ * @param num_files - number of input files
+ * @param options - options for every file system
+ */
+void run_parallel(char **input_files, int num_files, const Fs_options &options){
+	std::vector<char *> out_text(num_files), err_text(num_files);
+	std::vector<size_t> out_len(num_files), err_len(num_files);
+	std::atomic<int> next(0);
+	FileSystem *shared_fs = options.shared ? new FileSystem(options, stderr) : NULL;
+	int num_threads = options.shared ? num_files : std::max(1, std::min((int)std::thread::hardware_concurrency(), num_files)); // sessions of one disk run at once
+	std::vector<std::thread> threads;
+	for (int t=0; t<num_threads; t++){
+		threads.push_back(std::thread([&](){
+			for (int i = next++; i < num_files; i = next++){
+				FILE *out = open_memstream(&out_text[i], &out_len[i]);
+				FILE *err = open_memstream(&err_text[i], &err_len[i]);
+				Session session = make_session(out, err);
+				FileSystem *fs = shared_fs != NULL ? shared_fs : new FileSystem(options, err);
+				fs->run(session, input_files[i]);
+				if (fs != shared_fs) { delete fs; } // unmounts, write-back errors go with the file's output
+				fclose(out);
+				fclose(err);
+			}
+		}));
+	}
+	for (int t=0; t<num_threads; t++) { threads[t].join(); }
+	for (int i=0; i<num_files; i++){
+		fwrite(out_text[i], 1, out_len[i], stdout);
+		fflush(stdout);
+		fwrite(err_text[i], 1, err_len[i], stderr);
+		free(out_text[i]);
+		free(err_text[i]);
+	}
+	delete shared_fs;
+}
+
+int main(int argc, char *argv[]){
+	Fs_options options = { ALLOC_FIRST_FIT, FLUSH_ALWAYS, 1, 1, 0, false, false, false, false, false, DEFAULT_CACHE_BLOCKS };
+	const char *socket_path = NULL;
+	const char *stats_file = NULL;
+	Geometry format_geometry;
+	bool format = false;
+	bool checksums = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "a:c:d:f:g:jk:mst:uvx")) != -1){
+		if (opt == 'a' && Block_allocator::parse_policy(optarg, &options.alloc_policy)) { continue; }
+		if (opt == 'c' && parse_geometry(optarg, &format_geometry)) { format = true; continue; }
+		if (opt == 'd') { socket_path = optarg; continue; }
+		if (opt == 'f' && parse_flush_policy(optarg, options)) { continue; }
+		if (opt == 'g' && parse_growth_policy(optarg, options)) { continue; }
+		if (opt == 'j') { options.use_journal = true; continue; }
+		if (opt == 'k' && parse_cache_size(optarg, options)) { continue; }
+		if (opt == 'm') { options.use_mmap = true; continue; }
+		if (opt == 's') { options.shared = true; continue; }
+		if (opt == 't') { stats_file = optarg; continue; }
+		if (opt == 'u') { options.dedup = true; continue; }
+		if (opt == 'v') { options.verbose = true; continue; }
+		if (opt == 'x') { checksums = true; continue; }
+		fprintf(stderr, "Usage: %s [-a first|next|best|buddy] [-f always|exit|N] [-g none|double|N] [-j] [-k blocks] [-m] [-s] [-t stats.json] [-u] [-v] input_file...\n"
+			"       %s [options] -d socket\n"
+			"       %s -c 128K|64M|1G|4G|blocks:block_size:inodes [-x] disk...\n", argv[0], argv[0], argv[0]);
+		return 1;
+	}
+	if (options.use_journal && options.use_mmap){ // pages of a mapped disk can reach it before their changes are journaled
+		fprintf(stderr, "Error: A journal cannot be used with a memory-mapped disk\n");
+		return 1;
+	}
+	if (options.dedup && options.use_mmap){ // a mapped disk is used in place, one block per page
+		fprintf(stderr, "Error: Blocks of a memory-mapped disk cannot be deduplicated\n");
+		return 1;
+	}
+	int status = 0;
+	if (format){ // write empty disks of the given geometry
+		format_geometry.checksums = checksums;
+		for (int i=optind; i<argc; i++){
+			if (!format_disk(argv[i], format_geometry)) { fprintf(stderr, "Error: Cannot format disk %s\n", argv[i]); status = 1; }
+		}
+		return status;
+	}
+	if (socket_path != NULL){
+		status = run_daemon(socket_path, options);
+	}
+	else if (argc - optind < 1){
+		fprintf(stderr, "Error: Incorrect number of arguments");
+	}
+	else if (argc - optind == 1){
+		FileSystem *fs = new FileSystem(options, stderr);
+		Session session = make_session(stdout, stderr);
+		fs->run(session, argv[optind]);
+		delete fs;
+	}
+	else{
+		run_parallel(argv + optind, argc - optind, options);
+	}
+	if (stats_file != NULL) { write_stats(stats_file); }
+	return status;
+}
@@ -1,25 +1,245 @@
+#ifndef FILESYSTEM_H
+#define FILESYSTEM_H
+
 #include <stdio.h>
 #include <stdint.h>
+#include <string>
+#include <iosfwd>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include "Geometry.h"
+#include "Dir_index.h"
+#include "Allocator.h"
+#include "Journal.h"
+#include "Block_store.h"
+#include "Block_checksums.h"
+#include "Dirty_set.h"
+
+#define DEFAULT_CACHE_BLOCKS 65536 // data blocks kept in memory unless -k is given
+#define MAX_PATH_LENGTH 255 // longest path argument: names of at most 5 characters separated by '/'
+#define MAX_DENTRIES 1024 // most directory paths a session keeps resolved
+
+typedef enum {
+	FLUSH_ALWAYS,  // write back after every command
+	FLUSH_EVERY_N, // write back after every flush_interval commands
+	FLUSH_ON_EXIT  // write back only when the disk is unmounted or the program exits
+} Flush_policy;
+
+typedef struct {
+	Alloc_policy alloc_policy;  // Allocation policy applied to disks when they are mounted
+	Flush_policy flush_policy;
+	int flush_interval;         // Number of commands between write-backs for FLUSH_EVERY_N
+	int growth_factor;          // A file growing to n blocks keeps room for growth_factor*n blocks (1 reserves no headroom)
+	int growth_blocks;          // Extra blocks kept free after a file that grows
+	bool use_mmap;              // Mount disks by mapping them instead of copying them into memory
+	bool use_journal;           // Commit changes to a write-ahead journal before writing them to the disk
+	bool dedup;                 // Share one in-memory page between data blocks with identical contents
+	bool verbose;               // Report every consistency violation found on mount, not only the error code
+	bool shared;                // Sessions share the mounted disk: mounting the disk already mounted joins it
+	int cache_blocks;           // Most data blocks kept in memory for a disk that is not mapped, 0 for no limit
+} Fs_options;
 
+/**
+ * @brief A directory path resolved by a session, one that never goes up after going down. It stays valid until the
+ * directory it starts from or the one it reaches is deleted, since every directory in between is above one of them,
+ * and deleting it deletes that one.
+ */
 typedef struct {
-	char name[5];        // Name of the file or directory
-	uint8_t used_size;   // Inode state and the size of the file or directory
-	uint8_t start_block; // Index of the start file block
-	uint8_t dir_parent;  // Inode mode and the index of the parent inode
-} Inode;
+	int dir;           // Directory reached
+	uint32_t base_inc; // Incarnation of the directory the path starts from, when it was resolved
+	uint32_t dir_inc;  // Incarnation of the directory reached, when it was resolved
+} Dentry;
 
+/**
+ * @brief State of one command stream: its working directory, its data buffer and where its output goes
+ */
 typedef struct {
-	char free_block_list[16];
-	Inode inode[126];
-} Super_block;
-
-void fs_mount(char *new_disk_name);
-void fs_create(char name[5], int size);
-void fs_delete(char name[5]);
-void fs_read(char name[5], int block_num);
-void fs_write(char name[5], int block_num);
-void fs_buff(uint8_t buff[1024]);
-void fs_ls(void);
-void fs_resize(char name[5], int new_size);
-void fs_defrag(void);
-void fs_cd(char name[5]);
+	int cwd;                // Current working directory
+	uint8_t buffer[MAX_BLOCK_SIZE]; // Data buffer for read/write operations, of which a block is used
+	std::vector<uint8_t> staging; // Blocks moved by range reads and writes
+	FILE *out;              // Command output
+	FILE *err;              // Error messages
+	const char *input_file; // Input filename for running file system commands
+	std::unordered_map<std::string, Dentry> dentries; // Directory paths resolved, keyed by starting directory and path
+	uint64_t dentry_generation; // Mount the paths in dentries were resolved on
+} Session;
+
+/**
+ * @brief Creates a session in the root directory with an empty buffer
+ *
+ * @param out - stream for command output
+ * @param err - stream for error messages
+ */
+Session make_session(FILE *out, FILE *err);
+
+/**
+ * @brief A file system simulator serving one mounted disk at a time. All of its state belongs to the instance, so
+ * several instances can drive different disks on different threads. A disk should only be mounted by one instance at
+ * a time. The geometry of a disk (block size, number of blocks and number of inodes) is read from it when it is
+ * mounted; the inodes are kept decoded in memory and encoded back into the superblock when they are written back.
+ * Unless the disk is mapped, its data blocks are read on first access and kept in a cache of bounded size.
+ * Commands come from sessions, and several sessions can run commands on the same instance at once. Commands lock
+ * only what they touch: the directory they look names up in (shared) or change (exclusive), the data blocks of a
+ * file, and the allocator for the free block list and free inodes. Mounting, compaction, deleting a directory and
+ * writing back take the whole disk. Locks are always taken in the order disk, directory (parent before child),
+ * file, allocator.
+ */
+class FileSystem {
+public:
+	/**
+	 * @brief Creates a file system with no disk mounted
+	 *
+	 * @param options - options applied to every disk it mounts
+	 * @param err - stream for errors writing back to the disk outside of any command
+	 */
+	FileSystem(const Fs_options &options, FILE *err);
+	~FileSystem();
+	FileSystem(const FileSystem &) = delete;
+	FileSystem & operator=(const FileSystem &) = delete;
+
+	/**
+	 * @brief Runs every command of an input file in a session. The disk stays mounted.
+	 *
+	 * @param session - session running the commands
+	 * @param input_file - name of the input file
+	 */
+	void run(Session &session, const char *input_file);
+
+	/**
+	 * @brief Registers a session before it runs commands, so its working directory follows mounts and deleted directories
+	 *
+	 * @param session - session to register
+	 */
+	void attach(Session &session);
+
+	/**
+	 * @brief Unregisters a session that has stopped running commands
+	 *
+	 * @param session - session to unregister
+	 */
+	void detach(Session &session);
+
+	bool is_mounted() const { return mounted; }
+
+	void process_command(Session &session, char *line, int line_no, const uint8_t *payload = NULL, size_t payload_len = 0);
+	void fs_mount(Session &session, char *new_disk_name, Alloc_policy policy);
+	void fs_create(Session &session, const char *path, int size);
+	void fs_delete(Session &session, const char *path);
+	void fs_read(Session &session, const char *path, int block_num);
+	void fs_write(Session &session, const char *path, int block_num);
+	void fs_read_range(Session &session, const char *path, int first, int last, const char *host);
+	void fs_write_range(Session &session, const char *path, int first, int last, const char *host);
+	void fs_buff(Session &session, const uint8_t *data, size_t len);
+	void fs_ls(Session &session, const char *path);
+	void fs_resize(Session &session, const char *path, int new_size);
+	void fs_copy(Session &session, char src[5], char dst[5]);
+	void fs_clone(Session &session, char src[5], char dst[5]);
+	void fs_snapshot(Session &session, const char *name);
+	void fs_list_snapshots(Session &session);
+	void fs_rollback(Session &session, const char *name);
+	void fs_export(Session &session, const char *name, const char *file);
+	void fs_defrag(void);
+	void fs_defrag_background(int budget);
+	void fs_cd(Session &session, const char *path);
+	void fs_free(Session &session);
+	void fs_usage(Session &session, const char *name);
+	void fs_scrub(Session &session);
+	void unmount(void);
+
+private:
+	typedef struct {
+		int index; // inode of the file
+		int from;  // current start block
+		int to;    // start block once the disk is compacted
+		int size;  // number of blocks
+	} Defrag_move;
+
+	typedef struct {
+		std::string name;
+		std::vector<uint8_t> free_block_list; // free block list when the snapshot was taken
+		std::vector<Inode> inodes;            // inodes when the snapshot was taken
+		std::vector<uint8_t> checksums;       // checksum table when the snapshot was taken, empty if the disk has none
+		std::vector<int> pages;               // pinned page of every data block, NOT_LOADED while its disk copy is unchanged
+	} Snapshot;
+
+	typedef struct {
+		std::atomic<int64_t> blocks; // blocks of the files below the directory
+		std::atomic<int> files;      // files below the directory
+		std::atomic<int> dirs;       // directories below the directory
+	} Dir_usage; // Usage of a directory, counting everything below it
+
+	Fs_options options;
+	FILE *err; // Errors writing back outside of a command
+	Block_store block_store; // Disk data blocks, indexed by disk block number (the blocks before first_data hold the superblock)
+	char disk[21] = ""; // Name of mounted disk
+	std::atomic<bool> mounted{false}; // A disk is mounted, readable without holding the disk lock
+	Geometry geometry; // Geometry of the mounted disk, legacy when none is mounted
+	std::atomic<int> disk_blocks{128}; // Blocks of the mounted disk, readable without the disk lock to check command arguments
+	int root = 127; // Index of the root directory of the mounted disk
+	int first_data = 1; // First data block, after the blocks taken by the superblock
+	uint8_t * meta = NULL; // Superblock as on disk: the free block list, and the inodes as of the last write-back
+	std::vector<uint8_t> meta_buffer; // Holds the superblock unless the disk is mapped
+	std::vector<Inode> inodes; // Inodes of the mounted disk
+	int first_free_inode = 0; // No inode below it is free
+	Block_allocator block_allocator; // Contiguous block allocator over the free block list of the mounted disk
+	Block_checksums block_checksums; // Checksums of the data blocks in the superblock, if the mounted disk has them
+	std::vector<int> headroom; // Blocks reserved as growth headroom after the end of each file
+	std::atomic<int> defrag_budget{0}; // Blocks background compaction may move per command, 0 when it is not running
+	int defrag_credit = 0; // Unused budget carried over so a file larger than the budget eventually moves
+	Dir_index dir_index; // Children of every directory, keyed by directory inode (root for root)
+	Dir_index loaded_index; // Index built while mounting, kept if the disk mounts
+	std::unique_ptr<Dir_usage[]> usage; // Usage of every directory, updated along the path to root by every change
+	std::vector<uint32_t> incarnation; // Bumped when a directory is deleted, so the paths sessions resolved through it stop matching
+	uint64_t generation = 0; // Unique to the mount, so sessions drop the paths they resolved on another mount or instance
+	int disk_fd = -1; // File descriptor of the mounted disk, used for positioned write-back
+	uint8_t * disk_map = NULL; // Mapping of the mounted disk when use_mmap is set, of disk_bytes(geometry)
+	Journal journal; // Write-ahead journal of the mounted disk when use_journal is set
+	std::atomic<int> pending_commands{0}; // Commands executed since the last write-back
+	bool dirty_header = false; // Geometry header to be rewritten at the next write-back
+	Dirty_set dirty_free_list; // Words of the free block list (64 blocks each) changed since the last write-back
+	Dirty_set dirty_inodes; // Inodes changed since the last write-back
+	Dirty_set dirty_blocks; // Data blocks changed since the last write-back
+	std::vector<Snapshot> snapshots; // Snapshots of the mounted disk, oldest first
+	std::vector<Session *> sessions; // Sessions running commands, whose cwd is reset when it stops existing
+
+	std::shared_mutex disk_lock; // Shared by commands, exclusive to mount, compact, delete a directory or write back
+	std::unique_ptr<std::shared_mutex[]> dir_locks; // Children of a directory and their inodes: shared to look up, exclusive to change
+	std::unique_ptr<std::shared_mutex[]> file_locks; // Data blocks of a file: shared to read, exclusive to write or move
+	std::mutex alloc_lock; // Free block list, allocator, growth headroom and the in-use flag of every inode
+
+	void set_geometry(const Geometry &new_geometry);
+	void set_blocks_state(int start, int len, int val);
+	void clear_inode(int index);
+	int find_free_inode(void);
+	void clear_blocks(int start, int len);
+	void move_blocks(int from, int to, int len);
+	void copy_blocks(int from, int to, int len);
+	bool isDir(int index);
+	int check_dir_names(Session &session, const char * name);
+	int resolve_dir(Session &session, const char *path, size_t len);
+	int resolve_parent(Session &session, const char *path, const char **leaf);
+	bool write_range(struct iovec *pieces, int count, off_t offset);
+	bool write_to_disk(FILE *err);
+	void write_clean_marker(void);
+	void persist(Session &session);
+	void run_binary(Session &session, std::ifstream &in);
+	void release_headroom(int index);
+	int wanted_headroom(int size);
+	void reserve_headroom(int index);
+	void delete_file(int index);
+	void delete_tree(int index, std::vector<int> &deleted);
+	void add_usage(int dir, int64_t blocks, int files, int dirs);
+	void clear_usage(int dir);
+	void build_usage(void);
+	int find_snapshot(const char *name);
+	void drop_snapshots(void);
+	std::vector<Defrag_move> defrag_plan(void);
+	void defrag_move(const Defrag_move &move);
+	void defrag_step(void);
+};
+
+#endif
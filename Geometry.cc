@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include "Geometry.h"
+#include "Block_checksums.h"
+
+#define MAX_FIELD (1<<30) // wide inode fields past any geometry decode as this, which every check rejects
+
+Geometry legacy_geometry(void){
+	Geometry geometry = { Legacy_geometry::block_size, Legacy_geometry::num_blocks, Legacy_geometry::num_inodes, false };
+	return geometry;
+}
+
+/**
+ * @brief Checks that a geometry can be used: a power of two block size up to MAX_BLOCK_SIZE, a multiple of 64
+ * blocks with room for at least one data block, and at least one inode
+ *
+ * @param g - geometry to check
+ */
+static bool valid_geometry(const Geometry &g){
+	if (g.block_size < 512 || g.block_size > MAX_BLOCK_SIZE || (g.block_size & (g.block_size-1)) != 0) { return false; }
+	if (g.num_blocks < 64 || g.num_blocks > MAX_DISK_BLOCKS || g.num_blocks % 64 != 0) { return false; }
+	if (g.num_inodes < 1 || g.num_inodes > MAX_DISK_INODES) { return false; }
+	return meta_blocks(g) < g.num_blocks;
+}
+
+bool parse_geometry_header(const uint8_t *bytes, Geometry *geometry){
+	Geometry_header header;
+	memcpy(&header, bytes, sizeof(header));
+	bool checksums = memcmp(header.magic, CHECKSUM_MAGIC, 4) == 0;
+	if (memcmp(header.magic, GEOMETRY_MAGIC, 4) != 0 && !checksums) { *geometry = legacy_geometry(); return true; }
+	if (header.block_size > MAX_BLOCK_SIZE || header.num_blocks > MAX_DISK_BLOCKS || header.num_inodes > MAX_DISK_INODES) { return false; }
+	geometry->block_size = header.block_size;
+	geometry->num_blocks = header.num_blocks;
+	geometry->num_inodes = header.num_inodes;
+	geometry->checksums = checksums;
+	return valid_geometry(*geometry) && !is_legacy(*geometry); // the legacy geometry is only ever written without a header
+}
+
+bool read_geometry(int fd, Geometry *geometry){
+	uint8_t bytes[sizeof(Geometry_header)] = {0};
+	if (pread(fd, bytes, sizeof(bytes), 0) < 0) { return false; }
+	return parse_geometry_header(bytes, geometry);
+}
+
+bool parse_geometry(const char *arg, Geometry *geometry){
+	static const struct { const char *name; Geometry geometry; } presets[] = {
+		{ "128K", { Legacy_geometry::block_size, Legacy_geometry::num_blocks, Legacy_geometry::num_inodes, false } },
+		{ "64M", { Geometry_64M::block_size, Geometry_64M::num_blocks, Geometry_64M::num_inodes, false } },
+		{ "1G", { Geometry_1G::block_size, Geometry_1G::num_blocks, Geometry_1G::num_inodes, false } },
+		{ "4G", { Geometry_4G::block_size, Geometry_4G::num_blocks, Geometry_4G::num_inodes, false } },
+	};
+	for (size_t i=0; i<sizeof(presets)/sizeof(presets[0]); i++){
+		if (strcmp(arg, presets[i].name)==0) { *geometry = presets[i].geometry; return true; }
+	}
+	char rest;
+	geometry->checksums = false;
+	if (sscanf(arg, "%d:%d:%d%c", &geometry->num_blocks, &geometry->block_size, &geometry->num_inodes, &rest) != 3) { return false; }
+	return valid_geometry(*geometry);
+}
+
+/**
+ * @brief Reads a 32 bit field of a wide inode, limited to MAX_FIELD so sums of two fields cannot overflow
+ */
+static int wide_field(uint32_t value){
+	return value > MAX_FIELD ? MAX_FIELD : (int)value;
+}
+
+/**
+ * @brief Decodes every inode of a superblock laid out for a geometry
+ */
+template <typename G>
+static void decode_table(const G &g, const uint8_t *meta, Inode *inodes){
+	const uint8_t *table = meta + inode_offset(g);
+	for (int i=0; i<g.num_inodes; i++){
+		Inode &node = inodes[i];
+		if (is_legacy(g)){
+			Packed_inode packed;
+			memcpy(&packed, table + (size_t)i*sizeof(Packed_inode), sizeof(packed));
+			memcpy(node.name, packed.name, 5);
+			node.in_use = (packed.used_size & 128) != 0;
+			node.size = packed.used_size & 127;
+			node.start_block = packed.start_block;
+			node.is_dir = (packed.dir_parent & 128) != 0;
+			node.parent = packed.dir_parent & 127;
+		} else {
+			Wide_inode wide;
+			memcpy(&wide, table + (size_t)i*sizeof(Wide_inode), sizeof(wide));
+			memcpy(node.name, wide.name, 5);
+			node.in_use = (wide.mode & WIDE_IN_USE) != 0;
+			node.is_dir = (wide.mode & WIDE_DIR) != 0;
+			node.size = wide_field(wide.used_size);
+			node.start_block = wide_field(wide.start_block);
+			node.parent = wide_field(wide.dir_parent);
+		}
+	}
+}
+
+void decode_inodes(const Geometry &geometry, const uint8_t *meta, Inode *inodes){
+	with_geometry(geometry, [&](const auto &g){ decode_table(g, meta, inodes); });
+}
+
+void encode_inode(const Geometry &geometry, const Inode &node, uint8_t *meta, int index){
+	if (is_legacy(geometry)){
+		Packed_inode packed;
+		memcpy(packed.name, node.name, 5);
+		packed.used_size = (node.in_use ? 128 : 0) | (node.size & 127);
+		packed.start_block = node.start_block;
+		packed.dir_parent = (node.is_dir ? 128 : 0) | (node.parent & 127);
+		memcpy(meta + inode_offset(geometry) + (size_t)index*sizeof(Packed_inode), &packed, sizeof(packed));
+	} else {
+		Wide_inode wide;
+		memcpy(wide.name, node.name, 5);
+		wide.mode = (node.in_use ? WIDE_IN_USE : 0) | (node.is_dir ? WIDE_DIR : 0);
+		wide.unused = 0;
+		wide.used_size = node.size;
+		wide.start_block = node.start_block;
+		wide.dir_parent = node.parent;
+		memcpy(meta + inode_offset(geometry) + (size_t)index*sizeof(Wide_inode), &wide, sizeof(wide));
+	}
+}
+
+bool format_disk(const char *disk_name, const Geometry &geometry){
+	std::vector<uint8_t> meta(meta_blocks(geometry) * (size_t)geometry.block_size, 0);
+	if (!is_legacy(geometry)){
+		Geometry_header header = { {0}, (uint32_t)geometry.block_size, (uint32_t)geometry.num_blocks, (uint32_t)geometry.num_inodes };
+		memcpy(header.magic, geometry.checksums ? CHECKSUM_MAGIC : GEOMETRY_MAGIC, 4);
+		memcpy(meta.data(), &header, sizeof(header));
+	}
+	for (int b=0; b<meta_blocks(geometry); b++) { meta[bitmap_offset(geometry) + b/8] |= 128 >> (b%8); } // the superblock is in use
+	if (geometry.checksums){ // every data block is zeroed
+		std::vector<uint8_t> zeroes(geometry.block_size, 0);
+		uint32_t zero_crc = crc32c(zeroes.data(), zeroes.size());
+		for (int b=meta_blocks(geometry); b<geometry.num_blocks; b++) { memcpy(meta.data() + checksum_offset(geometry) + (size_t)b*4, &zero_crc, 4); }
+	}
+	int fd = open(disk_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) { return false; }
+	bool ok = write(fd, meta.data(), meta.size()) == (ssize_t)meta.size() && ftruncate(fd, disk_bytes(geometry)) == 0; // data blocks read as zeroes
+	return close(fd) == 0 && ok;
+}
@@ -0,0 +1,222 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MAX_BLOCK_SIZE 4096   // largest block size, and the size of the data buffer of a session
+#define MAX_DISK_BLOCKS (1<<22) // most blocks of a disk, 16GB with 4KB blocks
+#define MAX_DISK_INODES (1<<20) // most inodes of a disk
+#define GEOMETRY_MAGIC "FSG1" // first bytes of a disk with a geometry header
+#define CHECKSUM_MAGIC "FSC1" // first bytes of a disk with a geometry header and a checksum of every block
+
+// Legacy on-disk layout: 128 blocks of 1KB, where the superblock fills block 0 and is followed by 127 data blocks.
+// The structs are packed so a mapped disk image can be used in place.
+typedef struct __attribute__((packed)) {
+	char name[5];        // Name of the file or directory
+	uint8_t used_size;   // Inode state and the size of the file or directory
+	uint8_t start_block; // Index of the start file block
+	uint8_t dir_parent;  // Inode mode and the index of the parent inode
+} Packed_inode;
+
+typedef struct __attribute__((packed)) {
+	char free_block_list[16];
+	Packed_inode inode[126];
+} Super_block;
+
+static_assert(sizeof(Packed_inode) == 8, "Packed_inode must match its 8 byte on-disk layout");
+static_assert(sizeof(Super_block) == 1024, "Super_block must fill disk block 0");
+
+// Layout of a disk of any other geometry: block 0 starts with a header, followed by the free block list, the
+// inode table and, on a disk with checksums, a CRC32C of every block, which take as many blocks as they need before
+// the first data block. Fields are little endian.
+typedef struct __attribute__((packed)) {
+	char magic[4];       // GEOMETRY_MAGIC, or CHECKSUM_MAGIC with checksums; a legacy disk starts with block 0 marked used instead
+	uint32_t block_size;
+	uint32_t num_blocks;
+	uint32_t num_inodes;
+} Geometry_header;
+
+#define WIDE_IN_USE 1 // mode bits of a wide inode
+#define WIDE_DIR 2
+
+typedef struct __attribute__((packed)) {
+	char name[5];         // Name of the file or directory
+	uint8_t mode;         // WIDE_IN_USE and WIDE_DIR
+	uint16_t unused;
+	uint32_t used_size;   // Size of the file in blocks
+	uint32_t start_block; // Index of the start file block
+	uint32_t dir_parent;  // Index of the parent inode, num_inodes for root
+} Wide_inode;
+
+static_assert(sizeof(Wide_inode) == 20, "Wide_inode must match its 20 byte on-disk layout");
+
+/**
+ * @brief An inode as kept in memory, whatever the layout of its disk
+ */
+typedef struct {
+	char name[5];    // Name of the file or directory
+	bool in_use;
+	bool is_dir;
+	int size;        // Size of the file in blocks
+	int start_block; // Index of the start file block
+	int parent;      // Index of the parent inode, root_dir() for root
+} Inode;
+
+/**
+ * @brief Geometry of a mounted disk, read from its header. The legacy geometry has no header.
+ */
+typedef struct {
+	int block_size;
+	int num_blocks;
+	int num_inodes;
+	bool checksums; // the superblock ends with a checksum of every block
+} Geometry;
+
+/**
+ * @brief Geometry known at compile time. Code templated on a geometry type is instantiated for every common geometry,
+ * so its loops run over constant bounds, and for Geometry, which covers every other one.
+ */
+template <int BLOCK_SIZE, int NUM_BLOCKS, int NUM_INODES>
+struct Fixed_geometry {
+	static constexpr int block_size = BLOCK_SIZE;
+	static constexpr int num_blocks = NUM_BLOCKS;
+	static constexpr int num_inodes = NUM_INODES;
+	static constexpr bool checksums = false;
+};
+
+typedef Fixed_geometry<1024, 128, 126> Legacy_geometry;  // 128KB
+typedef Fixed_geometry<4096, 16384, 4096> Geometry_64M;   // 64MB
+typedef Fixed_geometry<4096, 262144, 32768> Geometry_1G;  // 1GB
+typedef Fixed_geometry<4096, 1048576, 65536> Geometry_4G; // 4GB
+
+template <typename G> inline bool is_legacy(const G &g){
+	return g.block_size == Legacy_geometry::block_size && g.num_blocks == Legacy_geometry::num_blocks && g.num_inodes == Legacy_geometry::num_inodes && !g.checksums;
+}
+
+/**
+ * @brief Index of the root directory: 127 on a legacy disk, the number of inodes otherwise
+ */
+template <typename G> inline int root_dir(const G &g){ return is_legacy(g) ? 127 : g.num_inodes; }
+
+/**
+ * @brief Byte offset of the free block list, one bit per block, most significant bit first
+ */
+template <typename G> inline size_t bitmap_offset(const G &g){ return is_legacy(g) ? 0 : sizeof(Geometry_header); }
+
+/**
+ * @brief Bytes of an on-disk inode
+ */
+template <typename G> inline size_t inode_bytes(const G &g){ return is_legacy(g) ? sizeof(Packed_inode) : sizeof(Wide_inode); }
+
+/**
+ * @brief Byte offset of the inode table
+ */
+template <typename G> inline size_t inode_offset(const G &g){ return bitmap_offset(g) + (size_t)g.num_blocks/8; }
+
+/**
+ * @brief Byte offset of the checksum table, 4 bytes per block, on a disk with checksums
+ */
+template <typename G> inline size_t checksum_offset(const G &g){ return inode_offset(g) + (size_t)g.num_inodes*inode_bytes(g); }
+
+/**
+ * @brief Bytes of the superblock: the header, the free block list, the inode table and the checksum table
+ */
+template <typename G> inline size_t meta_bytes(const G &g){ return checksum_offset(g) + (g.checksums ? (size_t)g.num_blocks*4 : 0); }
+
+/**
+ * @brief Blocks taken by the superblock, which is also the index of the first data block
+ */
+template <typename G> inline int meta_blocks(const G &g){ return (int)((meta_bytes(g) + g.block_size - 1) / g.block_size); }
+
+/**
+ * @brief Bytes of the whole disk
+ */
+template <typename G> inline size_t disk_bytes(const G &g){ return (size_t)g.num_blocks * g.block_size; }
+
+/**
+ * @brief Largest file size in blocks: 127 on a legacy disk, whose inodes keep the size in 7 bits, all the data blocks otherwise
+ */
+template <typename G> inline int max_file_blocks(const G &g){ return is_legacy(g) ? 127 : g.num_blocks - meta_blocks(g); }
+
+template <typename G> inline bool same_geometry(const Geometry &a, const G &b){
+	return a.block_size == b.block_size && a.num_blocks == b.num_blocks && a.num_inodes == b.num_inodes && a.checksums == b.checksums;
+}
+
+/**
+ * @brief Calls a function with the compile-time geometry matching a geometry, or with the geometry itself if it is
+ * not a common one
+ *
+ * @param geometry - geometry to match
+ * @param f - function taking a geometry of any type
+ */
+template <typename F> inline void with_geometry(const Geometry &geometry, F f){
+	if (same_geometry(geometry, Legacy_geometry())) { f(Legacy_geometry()); }
+	else if (same_geometry(geometry, Geometry_64M())) { f(Geometry_64M()); }
+	else if (same_geometry(geometry, Geometry_1G())) { f(Geometry_1G()); }
+	else if (same_geometry(geometry, Geometry_4G())) { f(Geometry_4G()); }
+	else { f(geometry); }
+}
+
+/**
+ * @brief The geometry of 128KB disks without a header
+ */
+Geometry legacy_geometry(void);
+
+/**
+ * @brief Reads the geometry of a disk from its first bytes: a valid header, or the legacy geometry if there is none
+ *
+ * @param bytes - first sizeof(Geometry_header) bytes of the disk, zeroes past its end
+ * @param geometry - set to the geometry of the disk
+ * @return false if the disk has a header describing an invalid geometry
+ */
+bool parse_geometry_header(const uint8_t *bytes, Geometry *geometry);
+
+/**
+ * @brief Reads the geometry of an open disk, as parse_geometry_header
+ *
+ * @param fd - file descriptor of the disk
+ * @param geometry - set to the geometry of the disk
+ * @return false if the disk has a header describing an invalid geometry
+ */
+bool read_geometry(int fd, Geometry *geometry);
+
+/**
+ * @brief Parses a geometry given on the command line: "128K", "64M", "1G", "4G", or blocks:block_size:inodes
+ *
+ * @param arg - geometry to parse
+ * @param geometry - set to the geometry, without checksums
+ * @return false if the argument is not a valid geometry
+ */
+bool parse_geometry(const char *arg, Geometry *geometry);
+
+/**
+ * @brief Decodes the inode table of a superblock
+ *
+ * @param geometry - geometry of the disk
+ * @param meta - superblock as on disk
+ * @param inodes - receives the num_inodes inodes
+ */
+void decode_inodes(const Geometry &geometry, const uint8_t *meta, Inode *inodes);
+
+/**
+ * @brief Encodes an inode into the inode table of a superblock
+ *
+ * @param geometry - geometry of the disk
+ * @param node - inode to encode
+ * @param meta - superblock as on disk
+ * @param index - inode index
+ */
+void encode_inode(const Geometry &geometry, const Inode &node, uint8_t *meta, int index);
+
+/**
+ * @brief Writes an empty disk: the superblock, with the blocks it takes marked used and the checksums of zeroed
+ * blocks if it has checksums, and zeroed data blocks
+ *
+ * @param disk_name - name of the disk to create or overwrite
+ * @param geometry - geometry of the disk, written with a header unless it is the legacy geometry
+ * @return false if the disk cannot be written
+ */
+bool format_disk(const char *disk_name, const Geometry &geometry);
+
+#endif
@@ -0,0 +1,106 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "Journal.h"
+#include "Checker.h"
+#include "Geometry.h"
+
+#define JOURNAL_MAGIC 0x324a5346 // "FSJ2", ranges with 64 bit offsets
+
+std::string Journal::path(const char *disk_name){
+	return std::string(disk_name) + ".journal";
+}
+
+bool Journal::open(const char *disk_name){
+	file = path(disk_name);
+	fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	length = 0;
+	staged.assign(sizeof(Header), 0);
+	num_ranges = 0;
+	return fd >= 0;
+}
+
+void Journal::close(bool remove){
+	if (fd < 0) { return; }
+	::close(fd);
+	fd = -1;
+	if (remove) { unlink(file.c_str()); }
+}
+
+void Journal::add(const void *data, uint32_t len, uint64_t offset){
+	Range range = { offset, len, 0 };
+	const uint8_t *r = (const uint8_t *)&range;
+	staged.insert(staged.end(), r, r + sizeof(Range));
+	staged.insert(staged.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+	num_ranges++;
+}
+
+bool Journal::commit(){
+	if (num_ranges == 0) { return true; }
+	Header header = { JOURNAL_MAGIC, num_ranges, (uint32_t)(staged.size() - sizeof(Header)), 0, 0 };
+	header.checksum = checksum64(staged.data() + sizeof(Header), header.length);
+	memcpy(staged.data(), &header, sizeof(Header));
+	bool ok = true;
+	for (size_t done = 0; ok && done < staged.size(); ){
+		ssize_t n = write(fd, staged.data() + done, staged.size() - done);
+		ok = n > 0;
+		done += ok ? n : 0;
+	}
+	ok = ok && fdatasync(fd)==0;
+	if (ok) { length += staged.size(); }
+	else if (ftruncate(fd, length)!=0) { ok = false; } // drop a partly written transaction so later ones stay readable
+	staged.assign(sizeof(Header), 0);
+	num_ranges = 0;
+	return ok;
+}
+
+bool Journal::checkpoint(){
+	if (ftruncate(fd, 0)!=0) { return false; }
+	length = 0;
+	return true;
+}
+
+int Journal::replay(const char *disk_name){
+	std::string name = path(disk_name);
+	int jfd = ::open(name.c_str(), O_RDONLY);
+	if (jfd < 0) { return 0; } // no journal, the disk was unmounted after its last transaction was synced
+	std::vector<uint8_t> log;
+	struct stat st;
+	if (fstat(jfd, &st)==0 && st.st_size > 0){
+		log.resize(st.st_size);
+		ssize_t n = pread(jfd, log.data(), log.size(), 0);
+		log.resize(n > 0 ? n : 0);
+	}
+	::close(jfd);
+
+	int disk_fd = ::open(disk_name, O_RDWR);
+	if (disk_fd < 0) { return -1; }
+	Geometry geometry;
+	if (!read_geometry(disk_fd, &geometry)) { geometry = legacy_geometry(); } // the disk fails to mount anyway
+	int replayed = 0;
+	bool ok = true;
+	size_t pos = 0;
+	while (ok && pos + sizeof(Header) <= log.size()){
+		Header header;
+		memcpy(&header, log.data() + pos, sizeof(Header));
+		const uint8_t *body = log.data() + pos + sizeof(Header);
+		if (header.magic != JOURNAL_MAGIC || header.length > log.size() - pos - sizeof(Header)) { break; }
+		if (checksum64(body, header.length) != header.checksum) { break; } // torn by a crash, never committed
+		for (size_t r = 0, at = 0; ok && r < header.num_ranges && at + sizeof(Range) <= header.length; r++){
+			Range range;
+			memcpy(&range, body + at, sizeof(Range));
+			at += sizeof(Range);
+			if (range.length > header.length - at || range.offset + range.length > disk_bytes(geometry)) { break; }
+			ok = pwrite(disk_fd, body + at, range.length, range.offset) == (ssize_t)range.length;
+			at += range.length;
+		}
+		pos += sizeof(Header) + header.length;
+		replayed++;
+	}
+	ok = ok && fsync(disk_fd)==0;
+	::close(disk_fd);
+	if (!ok) { return -1; } // keep the journal so the next mount can try again
+	unlink(name.c_str());
+	return replayed;
+}
@@ -0,0 +1,97 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#define JOURNAL_CHECKPOINT_BYTES (256*1024) // journal size at which the disk is synced and the journal emptied
+
+/**
+ * @brief Write-ahead journal of a disk, kept in <disk>.journal.
+ * Byte ranges of the disk are staged and then committed together as one transaction with a single fsync, before
+ * they are written to the disk. Each transaction starts with a header holding a checksum of its ranges, so a
+ * transaction torn by a crash is recognized and ignored when the journal is replayed.
+ */
+class Journal {
+public:
+	/**
+	 * @brief Creates an empty journal for a disk
+	 *
+	 * @param disk_name - name of the disk
+	 * @return false if the journal cannot be created
+	 */
+	bool open(const char *disk_name);
+
+	/**
+	 * @brief Closes the journal
+	 *
+	 * @param remove - true to delete the journal, once every transaction it holds has reached the synced disk
+	 */
+	void close(bool remove);
+
+	bool is_open() const { return fd >= 0; }
+
+	/**
+	 * @brief Stages a byte range of the disk for the next transaction
+	 *
+	 * @param data - new contents of the range
+	 * @param len - number of bytes
+	 * @param offset - byte offset of the range in the disk
+	 */
+	void add(const void *data, uint32_t len, uint64_t offset);
+
+	/**
+	 * @brief Appends the staged ranges to the journal as one transaction and syncs the journal
+	 *
+	 * @return false if the transaction could not be made durable
+	 */
+	bool commit();
+
+	/**
+	 * @brief Empties the journal. Only valid once the disk has been synced.
+	 *
+	 * @return false if the journal could not be truncated
+	 */
+	bool checkpoint();
+
+	/**
+	 * @brief Number of bytes in the journal
+	 */
+	off_t size() const { return length; }
+
+	/**
+	 * @brief Writes the committed transactions of a disk's journal, if it has one, to the disk, syncs the disk and
+	 * deletes the journal. Stops at the first torn or corrupt transaction.
+	 *
+	 * @param disk_name - name of the disk
+	 * @return Number of transactions replayed, or -1 if the disk could not be written
+	 */
+	static int replay(const char *disk_name);
+
+private:
+	typedef struct {
+		uint32_t magic;      // JOURNAL_MAGIC
+		uint32_t num_ranges; // ranges in the transaction
+		uint32_t length;     // bytes of ranges following the header
+		uint32_t unused;
+		uint64_t checksum;   // checksum64 of the bytes following the header
+	} Header;
+
+	typedef struct {
+		uint64_t offset; // byte offset in the disk
+		uint32_t length; // bytes of data following
+		uint32_t unused;
+	} Range;
+
+	int fd = -1;
+	std::string file;
+	off_t length = 0;
+	std::vector<uint8_t> staged; // header followed by the staged ranges
+	uint32_t num_ranges = 0;
+
+	static std::string path(const char *disk_name);
+};
+
+#endif
@@ -0,0 +1,226 @@
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include "Stats.h"
+
+typedef struct {
+	std::atomic<uint64_t> counters[NUM_STATS];
+	std::atomic<uint64_t> count[NUM_COMMAND_KINDS];
+	std::atomic<uint64_t> sampled[NUM_COMMAND_KINDS];
+	std::atomic<uint64_t> total_ticks[NUM_COMMAND_KINDS]; // of the sampled commands
+	std::atomic<uint64_t> latency[NUM_COMMAND_KINDS][NUM_LATENCY_BUCKETS];
+	std::atomic<uint64_t> unsampled; // commands since the last one timed
+} Thread_stats; // Counters written only by their thread, read by reports
+
+static const char *counter_names[NUM_STATS] = {
+	"bytes_written", "disk_writes", "blocks_moved", "alloc_searches", "alloc_extents_visited", "dir_lookups", "dir_probes",
+	"blocks_loaded", "blocks_evicted", "path_hits", "path_misses",
+	"blocks_verified", "checksum_errors"
+};
+
+static std::mutex registry_lock; // guards the two below
+static std::vector<Thread_stats *> live_stats; // counters of the running threads
+static Thread_stats retired_stats; // counters of the threads that have exited
+
+/**
+ * @brief Adds to a counter owned by the calling thread. A plain load and store, since no other thread writes it.
+ */
+static inline void bump(std::atomic<uint64_t> &counter, uint64_t n){
+	counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Adds every counter of one set to another
+ */
+static void merge(Thread_stats &into, const Thread_stats &from){
+	for (int i=0; i<NUM_STATS; i++) { into.counters[i] += from.counters[i].load(std::memory_order_relaxed); }
+	for (int k=0; k<NUM_COMMAND_KINDS; k++){
+		into.count[k] += from.count[k].load(std::memory_order_relaxed);
+		into.sampled[k] += from.sampled[k].load(std::memory_order_relaxed);
+		into.total_ticks[k] += from.total_ticks[k].load(std::memory_order_relaxed);
+		for (int b=0; b<NUM_LATENCY_BUCKETS; b++) { into.latency[k][b] += from.latency[k][b].load(std::memory_order_relaxed); }
+	}
+}
+
+/**
+ * @brief Registers the counters of a thread while it runs, and keeps them in the retired counters once it exits
+ */
+class Registration {
+public:
+	Thread_stats *stats;
+	Registration() : stats(new Thread_stats()){
+		std::lock_guard<std::mutex> lock(registry_lock);
+		live_stats.push_back(stats);
+	}
+	~Registration(){
+		std::lock_guard<std::mutex> lock(registry_lock);
+		merge(retired_stats, *stats);
+		live_stats.erase(std::find(live_stats.begin(), live_stats.end(), stats));
+		delete stats;
+	}
+};
+
+static thread_local Thread_stats *thread_stats = NULL; // counters of the calling thread, once registered
+
+/**
+ * @brief Registers the counters of the calling thread on its first count
+ */
+static Thread_stats * register_thread(){
+	thread_local Registration registration;
+	thread_stats = registration.stats;
+	return thread_stats;
+}
+
+/**
+ * @brief Counters of the calling thread
+ */
+static inline Thread_stats & local_stats(){
+	return *(thread_stats != NULL ? thread_stats : register_thread());
+}
+
+/**
+ * @brief Time in nanoseconds from the monotonic clock
+ */
+static uint64_t monotonic_ns(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec*1000000000ULL + now.tv_nsec;
+}
+
+static const uint64_t origin_ticks = stats_clock(); // clock readings at startup, to convert ticks to nanoseconds
+static const uint64_t origin_ns = monotonic_ns();
+
+void stats_add(Stat_counter counter, uint64_t n){
+	bump(local_stats().counters[counter], n);
+}
+
+/**
+ * @brief Kind of a command: its letter from 0 to 25, or NUM_COMMAND_KINDS-1 for anything else
+ */
+static inline int command_kind(char command){
+	return (command >= 'A' && command <= 'Z') ? command - 'A' : NUM_COMMAND_KINDS-1;
+}
+
+uint64_t stats_start(char command){
+	Thread_stats &stats = local_stats();
+	uint64_t unsampled = stats.unsampled.load(std::memory_order_relaxed) + 1;
+	bool sample = unsampled >= STATS_SAMPLE_EVERY || stats.count[command_kind(command)].load(std::memory_order_relaxed) == 0;
+	stats.unsampled.store(sample ? 0 : unsampled, std::memory_order_relaxed);
+	return sample ? stats_clock() | 1 : 0;
+}
+
+void stats_command(char command, uint64_t started){
+	int kind = command_kind(command);
+	Thread_stats &stats = local_stats();
+	bump(stats.count[kind], 1);
+	if (started == 0) { return; }
+	uint64_t ticks = stats_clock() - started;
+	int bucket = std::min(63 - __builtin_clzll(ticks | 1), NUM_LATENCY_BUCKETS-1);
+	bump(stats.sampled[kind], 1);
+	bump(stats.total_ticks[kind], ticks);
+	bump(stats.latency[kind][bucket], 1);
+}
+
+uint64_t stats_clock(void){
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc(); // a few nanoseconds, where reading the monotonic clock can take tens
+#else
+	return monotonic_ns();
+#endif
+}
+
+/**
+ * @brief Nanoseconds per clock tick, measured against the monotonic clock since startup
+ */
+static double ns_per_tick(){
+	while (monotonic_ns() - origin_ns < 2000000) { } // at least 2ms apart for a stable ratio
+	uint64_t ns = monotonic_ns(), ticks = stats_clock();
+	return ticks > origin_ticks ? (double)(ns - origin_ns) / (ticks - origin_ticks) : 1.0;
+}
+
+/**
+ * @brief Name of a command kind: its letter, or "invalid"
+ */
+static const char * command_name(int kind, char name[2]){
+	if (kind >= 26) { return "invalid"; }
+	name[0] = 'A' + kind;
+	name[1] = '\0';
+	return name;
+}
+
+/**
+ * @brief Mean latency of the sampled commands of one kind, in clock ticks
+ */
+static double mean_ticks(const Thread_stats &stats, int kind){
+	return stats.sampled[kind] == 0 ? 0 : (double)stats.total_ticks[kind] / stats.sampled[kind];
+}
+
+/**
+ * @brief Latency below which a fraction of the sampled commands of one kind ran, from the upper bounds of the histogram buckets
+ *
+ * @param stats - counters to read
+ * @param kind - command kind
+ * @param fraction - fraction of the commands, 0.5 for the median
+ * @return Latency in clock ticks
+ */
+static uint64_t percentile(const Thread_stats &stats, int kind, double fraction){
+	uint64_t wanted = (uint64_t)(fraction * stats.sampled[kind] + 0.5);
+	uint64_t seen = 0;
+	for (int b=0; b<NUM_LATENCY_BUCKETS; b++){
+		seen += stats.latency[kind][b];
+		if (seen >= wanted && seen > 0) { return 2ULL << b; }
+	}
+	return 0;
+}
+
+void stats_report(FILE *out, bool json){
+	Thread_stats *total = new Thread_stats();
+	{
+		std::lock_guard<std::mutex> lock(registry_lock);
+		merge(*total, retired_stats);
+		for (size_t i=0; i<live_stats.size(); i++) { merge(*total, *live_stats[i]); }
+	}
+	const Thread_stats &stats = *total;
+	double scale = ns_per_tick();
+	if (json){
+		fprintf(out, "{\"ns_per_tick\": %.6f,\n\"commands\": {", scale);
+		bool first = true;
+		for (int k=0; k<NUM_COMMAND_KINDS; k++){
+			if (stats.count[k] == 0) { continue; }
+			char name[2];
+			fprintf(out, "%s\n  \"%s\": {\"count\": %llu, \"sampled\": %llu, \"mean_ns\": %.0f, \"p50_ns\": %.0f, \"p99_ns\": %.0f, \"histogram_log2_ticks\": [",
+				first ? "" : ",", command_name(k, name), (unsigned long long)stats.count[k], (unsigned long long)stats.sampled[k],
+				mean_ticks(stats, k) * scale, percentile(stats, k, 0.5) * scale, percentile(stats, k, 0.99) * scale);
+			int last = NUM_LATENCY_BUCKETS-1;
+			while (last > 0 && stats.latency[k][last] == 0) { last--; }
+			for (int b=0; b<=last; b++) { fprintf(out, "%s%llu", b ? ", " : "", (unsigned long long)stats.latency[k][b]); }
+			fprintf(out, "]}");
+			first = false;
+		}
+		fprintf(out, "\n}");
+		for (int i=0; i<NUM_STATS; i++) { fprintf(out, ",\n\"%s\": %llu", counter_names[i], (unsigned long long)stats.counters[i]); }
+		fprintf(out, "\n}\n");
+	} else {
+		fprintf(out, "Command     Count   Total ms    Mean us     p50 us     p99 us   (1 in %d commands timed)\n", STATS_SAMPLE_EVERY);
+		for (int k=0; k<NUM_COMMAND_KINDS; k++){
+			if (stats.count[k] == 0) { continue; }
+			char name[2];
+			fprintf(out, "%-7s %9llu %10.3f %10.3f %10.3f %10.3f\n", command_name(k, name), (unsigned long long)stats.count[k],
+				mean_ticks(stats, k) * stats.count[k] * scale / 1e6, mean_ticks(stats, k) * scale / 1e3,
+				percentile(stats, k, 0.5) * scale / 1e3, percentile(stats, k, 0.99) * scale / 1e3);
+		}
+		fprintf(out, "Bytes written: %llu in %llu writes\n", (unsigned long long)stats.counters[STAT_BYTES_WRITTEN], (unsigned long long)stats.counters[STAT_DISK_WRITES]);
+		fprintf(out, "Blocks moved: %llu\n", (unsigned long long)stats.counters[STAT_BLOCKS_MOVED]);
+		fprintf(out, "Allocator searches: %llu, free extents visited: %llu\n", (unsigned long long)stats.counters[STAT_ALLOC_SEARCHES], (unsigned long long)stats.counters[STAT_ALLOC_EXTENTS]);
+		fprintf(out, "Directory lookups: %llu, probes: %llu\n", (unsigned long long)stats.counters[STAT_DIR_LOOKUPS], (unsigned long long)stats.counters[STAT_DIR_PROBES]);
+		fprintf(out, "Blocks loaded: %llu, evicted: %llu\n", (unsigned long long)stats.counters[STAT_BLOCKS_LOADED], (unsigned long long)stats.counters[STAT_BLOCKS_EVICTED]);
+		fprintf(out, "Path cache hits: %llu, misses: %llu\n", (unsigned long long)stats.counters[STAT_PATH_HITS], (unsigned long long)stats.counters[STAT_PATH_MISSES]);
+		fprintf(out, "Blocks verified: %llu, checksum errors: %llu\n", (unsigned long long)stats.counters[STAT_BLOCKS_VERIFIED], (unsigned long long)stats.counters[STAT_CHECKSUM_ERRORS]);
+	}
+	delete total;
+}
@@ -0,0 +1,68 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define NUM_LATENCY_BUCKETS 40 // bucket k counts latencies of [2^k, 2^(k+1)) clock ticks
+#define NUM_COMMAND_KINDS 27   // commands A to Z, and invalid commands
+#define STATS_SAMPLE_EVERY 8   // one command in this many is timed, as well as the first of each kind
+
+typedef enum {
+	STAT_BYTES_WRITTEN,   // bytes written back to disks by write_to_disk
+	STAT_DISK_WRITES,     // positioned writes (or syncs of mapped pages) issued by write_to_disk
+	STAT_BLOCKS_MOVED,    // data blocks moved by fs_resize and compaction
+	STAT_ALLOC_SEARCHES,  // runs searched for by the block allocator
+	STAT_ALLOC_EXTENTS,   // free extents or aligned slots visited by those searches
+	STAT_DIR_LOOKUPS,     // names looked up in directory indexes
+	STAT_DIR_PROBES,      // hash table slots compared by those lookups
+	STAT_BLOCKS_LOADED,   // data blocks loaded from disk on first access
+	STAT_BLOCKS_EVICTED,  // data blocks evicted from memory by the block cache
+	STAT_PATH_HITS,       // directory paths found resolved in the cache of a session
+	STAT_PATH_MISSES,     // directory paths resolved name by name
+	STAT_BLOCKS_VERIFIED, // data blocks checksummed and compared with their stored checksum
+	STAT_CHECKSUM_ERRORS, // data blocks that did not match their stored checksum
+	NUM_STATS
+} Stat_counter;
+
+/**
+ * @brief Adds to a process-wide counter. Every thread counts into its own counters without synchronization, and the
+ * counters of all threads are only summed when a report is made, so counting is cheap enough to leave on.
+ *
+ * @param counter - counter to add to
+ * @param n - amount to add
+ */
+void stats_add(Stat_counter counter, uint64_t n);
+
+/**
+ * @brief Called when a command starts. Decides if the command is timed, so that reading the clock stays off the
+ * path of most commands.
+ *
+ * @param command - command letter
+ * @return Clock reading to pass to stats_command, or 0 if the command is not timed
+ */
+uint64_t stats_start(char command);
+
+/**
+ * @brief Records a command when it ends, with its latency if it is timed
+ *
+ * @param command - command letter, or anything else for an invalid command
+ * @param started - value returned by stats_start
+ */
+void stats_command(char command, uint64_t started);
+
+/**
+ * @brief Reads a cheap clock for timing commands: the CPU time stamp counter where there is one, the monotonic clock
+ * in nanoseconds otherwise. Reports convert ticks to nanoseconds.
+ */
+uint64_t stats_clock(void);
+
+/**
+ * @brief Writes the counters of every thread so far, with per-command counts and latency percentiles
+ *
+ * @param out - stream to write to
+ * @param json - true for a JSON object, false for a human-readable table
+ */
+void stats_report(FILE *out, bool json);
+
+#endif
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+// Generates synthetic command traces for benchmarking. Every trace mounts BENCH_DISK, an empty disk in the working
+// directory, and is deterministic for a given seed.
+#define BENCH_DISK "bench_disk"
+
+typedef struct {
+	std::mt19937 rng;
+	std::vector<std::string> names; // files that should exist in the working directory
+} Trace;
+
+/**
+ * @brief Uniform random integer in [lo, hi]
+ */
+static int pick(Trace &t, int lo, int hi){
+	return std::uniform_int_distribution<int>(lo, hi)(t.rng);
+}
+
+/**
+ * @brief A file or directory name of at most 5 characters, from a pool of the given size
+ */
+static std::string name_of(int n){
+	char name[6];
+	snprintf(name, sizeof(name), "f%d", n);
+	return name;
+}
+
+/**
+ * @brief Removes a name from the live names, if present
+ */
+static void forget(Trace &t, const std::string &name){
+	for (size_t i=0; i<t.names.size(); i++){
+		if (t.names[i] == name) { t.names[i] = t.names.back(); t.names.pop_back(); return; }
+	}
+}
+
+/**
+ * @brief A live name, or a name from the pool if there is none
+ */
+static std::string live(Trace &t, int pool){
+	if (t.names.empty()) { return name_of(pick(t, 0, pool-1)); }
+	return t.names[pick(t, 0, t.names.size()-1)];
+}
+
+/**
+ * @brief Files are created and deleted in the root directory, with a listing now and then
+ */
+static void churn(Trace &t, int commands){
+	for (int i=0; i<commands; i++){
+		int k = pick(t, 0, 99);
+		if (k < 45){
+			std::string name = name_of(pick(t, 0, 39));
+			printf("C %s %d\n", name.c_str(), pick(t, 1, 8));
+			forget(t, name);
+			t.names.push_back(name);
+		} else if (k < 90){
+			std::string name = live(t, 40);
+			printf("D %s\n", name.c_str());
+			forget(t, name);
+		} else if (k < 95) { printf("L\n"); }
+		else { printf("F\n"); }
+	}
+}
+
+/**
+ * @brief A few files grow and shrink, with writes to their blocks in between
+ */
+static void resize(Trace &t, int commands){
+	int sizes[8];
+	for (int f=0; f<8; f++) { sizes[f] = 2; printf("C %s 2\n", name_of(f).c_str()); }
+	for (int i=8; i<commands; i++){
+		int f = pick(t, 0, 7);
+		if (pick(t, 0, 2) < 2){
+			int size = std::max(1, sizes[f] + pick(t, -4, 6));
+			if (size > 30) { size = pick(t, 1, 4); }
+			printf("E %s %d\n", name_of(f).c_str(), size);
+			sizes[f] = size; // a resize that fails keeps the old size, writes past it then report an error
+		} else {
+			printf("W %s %d\n", name_of(f).c_str(), pick(t, 0, sizes[f]-1));
+		}
+	}
+}
+
+/**
+ * @brief Walks down and up a chain of nested directories, creating, listing and deleting files at every depth
+ */
+static void deep(Trace &t, int commands){
+	const int max_depth = 24; // with up to 4 files per directory, the inodes never run out
+	int depth = 0;
+	for (int i=0; i<commands; i++){
+		int k = pick(t, 0, 99);
+		if (k < 30 && depth < max_depth){
+			printf("C d 0\nY d\n"); // C reports an error once d exists, Y still goes down
+			depth++;
+			i++;
+		} else if (k < 55 && depth > 0){
+			printf("Y ..\n");
+			depth--;
+		} else if (k < 70) { printf("C %s %d\n", name_of(pick(t, 0, 3)).c_str(), pick(t, 1, 2)); }
+		else if (k < 80) { printf("D %s\n", name_of(pick(t, 0, 3)).c_str()); }
+		else if (k < 95) { printf("L\n"); }
+		else { printf("Y .\n"); }
+	}
+}
+
+/**
+ * @brief Builds a chain of nested directories with two files at every depth, then reads, writes, resizes and lists
+ * them by absolute path without leaving the root directory
+ */
+static void paths(Trace &t, int commands){
+	const int depth = 12; // 36 inodes and at most 48 blocks, which fit a 128KB disk
+	std::string dir;
+	for (int d=0; d<depth; d++){
+		dir += "/d";
+		printf("C %s 0\n", dir.c_str());
+		for (int f=0; f<2; f++) { printf("C %s/%s 1\n", dir.c_str(), name_of(f).c_str()); }
+	}
+	for (int i=3*depth; i<commands; i++){
+		std::string path;
+		for (int d=pick(t, 1, depth); d>0; d--) { path += "/d"; }
+		int k = pick(t, 0, 99);
+		if (k < 45) { printf("R %s/%s 0\n", path.c_str(), name_of(pick(t, 0, 1)).c_str()); }
+		else if (k < 85) { printf("W %s/%s 0\n", path.c_str(), name_of(pick(t, 0, 1)).c_str()); }
+		else if (k < 95) { printf("L %s\n", path.c_str()); }
+		else { printf("E %s/%s %d\n", path.c_str(), name_of(pick(t, 0, 1)).c_str(), pick(t, 1, 2)); }
+	}
+}
+
+/**
+ * @brief Files are filled once, then mostly read, with a few buffer updates and writes
+ */
+static void read_mostly(Trace &t, int commands){
+	for (int f=0; f<16; f++){
+		printf("C %s 6\nB data%d\n", name_of(f).c_str(), f);
+		for (int b=0; b<6; b++) { printf("W %s %d\n", name_of(f).c_str(), b); }
+	}
+	for (int i=16*8; i<commands; i++){
+		int k = pick(t, 0, 99);
+		if (k < 90) { printf("R %s %d\n", name_of(pick(t, 0, 15)).c_str(), pick(t, 0, 5)); }
+		else if (k < 95) { printf("B x%d\n", i); }
+		else { printf("W %s %d\n", name_of(pick(t, 0, 15)).c_str(), pick(t, 0, 5)); }
+	}
+}
+
+/**
+ * @brief The disk is fragmented by small files with every other one deleted, then large files are created and the
+ * disk compacted, in the foreground or the background
+ */
+static void defrag(Trace &t, int commands){
+	for (int i=0; i<commands; ){
+		for (int f=0; f<40 && i<commands; f++, i++) { printf("C %s %d\n", name_of(f).c_str(), pick(t, 1, 3)); }
+		for (int f=0; f<40 && i<commands; f+=2, i++) { printf("D %s\n", name_of(f).c_str()); }
+		if (i++ < commands) { printf("C big %d\n", pick(t, 10, 30)); }
+		if (i++ < commands) { printf(pick(t, 0, 1) ? "O\n" : "O 8\n"); }
+		for (int f=0; f<6 && i<commands; f++, i++) { printf("W %s 0\n", name_of(2*f+1).c_str()); }
+		if (i++ < commands) { printf("C big %d\n", pick(t, 10, 30)); }
+		if (i++ < commands) { printf("O\n"); }
+		for (int f=1; f<40 && i<commands; f+=2, i++) { printf("D %s\n", name_of(f).c_str()); }
+		if (i++ < commands) { printf("D big\n"); }
+	}
+}
+
+int main(int argc, char *argv[]){
+	if (argc != 4){
+		fprintf(stderr, "Usage: %s churn|resize|deep|paths|read|defrag commands seed\n", argv[0]);
+		return 1;
+	}
+	Trace t;
+	t.rng.seed(strtoul(argv[3], NULL, 10));
+	int commands = atoi(argv[2]);
+	printf("M %s\n", BENCH_DISK);
+	if (strcmp(argv[1], "churn")==0) { churn(t, commands); }
+	else if (strcmp(argv[1], "resize")==0) { resize(t, commands); }
+	else if (strcmp(argv[1], "deep")==0) { deep(t, commands); }
+	else if (strcmp(argv[1], "paths")==0) { paths(t, commands); }
+	else if (strcmp(argv[1], "read")==0) { read_mostly(t, commands); }
+	else if (strcmp(argv[1], "defrag")==0) { defrag(t, commands); }
+	else { fprintf(stderr, "Error: Unknown workload %s\n", argv[1]); return 1; }
+	return 0;
+}
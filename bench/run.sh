@@ -0,0 +1,24 @@
+#!/bin/sh
+# Runs every benchmark workload through ./fs and reports throughput, per-command latency and bytes written.
+# Usage: bench/run.sh [commands per trace] [fs options...], run from the directory holding fs
+COMMANDS=${1:-100000}
+[ $# -gt 0 ] && shift
+FS=$(pwd)/fs
+GEN=$(pwd)/bench/gen_trace
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+printf "%-8s %9s %9s %12s %14s %8s\n" Workload Commands Seconds Commands/s "Bytes written" Writes
+for workload in churn resize deep paths read defrag; do
+	"$GEN" $workload $COMMANDS 1 | head -c -1 > "$WORK/$workload.trace" # fs reads a final newline as an empty command
+	printf '\200' > "$WORK/bench_disk" # empty disk: only the superblock block is in use
+	truncate -s 131072 "$WORK/bench_disk"
+	start=$(date +%s%N)
+	(cd "$WORK" && "$FS" "$@" -t $workload.json $workload.trace > /dev/null 2> $workload.err)
+	end=$(date +%s%N)
+	lines=$(($(wc -l < "$WORK/$workload.trace") + 1))
+	awk -v w=$workload -v n=$lines -v ns=$((end - start)) '
+		/^Bytes written:/ { bytes = $3; writes = $5 }
+		END { s = ns / 1e9; printf "%-8s %9d %9.3f %12.0f %14d %8d\n", w, n, s, n / s, bytes, writes }' "$WORK/$workload.err"
+	sed -n '/^Command  *Count/,/^Bytes written:/p' "$WORK/$workload.err" | sed '$d' | sed 's/^/    /'
+done